@@ -196,7 +196,7 @@ static AVLNode *avl_del(AVLNode *node){
 
 // offset into the succeeding or preceding node.
 // note: the worst-case is O(log(n)) regardless of how long the offset is.
-static AVLNode *avl_offset(AVLNode *node, int64_t offset) {
+static inline AVLNode *avl_offset(AVLNode *node, int64_t offset) {
     int64_t pos = 0;    // relative to the starting node
     while (offset != pos) {
         if (pos < offset && pos + avl_cnt(node->right) >= offset) {
@@ -223,3 +223,95 @@ static AVLNode *avl_offset(AVLNode *node, int64_t offset) {
     }
     return node;
 }
+
+// 节点在整棵树中序遍历里的位置，从0开始。
+// 沿着父节点往上走，每次从右边上来就加上左兄弟子树和父节点本身
+static inline uint64_t avl_rank(AVLNode *node){
+    uint64_t rank = avl_cnt(node->left);
+    while(node->parent){
+        if(node->parent->right == node){
+            rank += avl_cnt(node->parent->left) + 1;
+        }
+        node = node->parent;
+    }
+    return rank;
+}
+
+// 把l、mid、r接成一棵树，要求l中的节点 < mid < r中的节点，返回新的根。
+// 沿较高那棵树的边往下找到和矮的那棵高度相当的位置挂上去，
+// 然后和插入一样往上修复，代价是两棵树的高度差
+static AVLNode *avl_join(AVLNode *l, AVLNode *mid, AVLNode *r){
+    mid->parent = NULL;
+    uint32_t dl = avl_depth(l), dr = avl_depth(r);
+    if(dl <= dr + 1 && dr <= dl + 1){
+        mid->left = l;
+        mid->right = r;
+        if(l){
+            l->parent = mid;
+        }
+        if(r){
+            r->parent = mid;
+        }
+        avl_update(mid);
+        return mid;
+    }
+    bool left_taller = dl > dr;
+    AVLNode *parent = NULL;
+    AVLNode *cur = left_taller ? l : r;
+    uint32_t want = (left_taller ? dr : dl) + 1;
+    while(avl_depth(cur) > want){
+        parent = cur;
+        cur = left_taller ? cur->right : cur->left;
+    }
+    // cur和矮的那棵树做mid的两个孩子，mid顶替cur原来的位置
+    mid->left = left_taller ? cur : l;
+    mid->right = left_taller ? r : cur;
+    if(mid->left){
+        mid->left->parent = mid;
+    }
+    if(mid->right){
+        mid->right->parent = mid;
+    }
+    mid->parent = parent;
+    (left_taller ? parent->right : parent->left) = mid;
+    return avl_fix(mid);
+}
+
+// 没有中间节点时，从r里取出最小的节点当mid
+static inline AVLNode *avl_join2(AVLNode *l, AVLNode *r){
+    if(!l || !r){
+        return l ? l : r;
+    }
+    AVLNode *mid = r;
+    while(mid->left){
+        mid = mid->left;
+    }
+    r = avl_del(mid);
+    return avl_join(l, mid, r);
+}
+
+// 按中序把树分成前k个节点和剩下的，两棵树的根分别放到l和r。
+// 每一层做一次join，高度差加起来是O(log n)
+static void avl_split(AVLNode *node, uint64_t k, AVLNode **l, AVLNode **r){
+    if(!node){
+        *l = *r = NULL;
+        return;
+    }
+    AVLNode *left = node->left, *right = node->right;
+    if(left){
+        left->parent = NULL;
+    }
+    if(right){
+        right->parent = NULL;
+    }
+    uint64_t lcnt = avl_cnt(left);
+    if(k <= lcnt){
+        AVLNode *rest = NULL;
+        avl_split(left, k, l, &rest);
+        *r = avl_join(rest, node, right);
+    }else{
+        AVLNode *rest = NULL;
+        avl_split(right, k - lcnt - 1, &rest, r);
+        *l = avl_join(left, node, rest);
+    }
+}
@@ -0,0 +1,174 @@
+// usage: bench_client [threads] [conns/thread] [depth] [seconds] [nkeys]
+// g++ -O2 bench_client.cpp -o bench_client -lpthread
+// 压测一个已经启动的server: 每个连接一次发出depth个请求(90% GET, 10% SET)，
+// 读完所有回复再发下一批，最后输出每秒完成的请求数
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+static void die(const char *msg) {
+    fprintf(stderr, "[%d] %s\n", errno, msg);
+    abort();
+}
+
+static uint64_t now_ns() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static int connect_server() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs(1234);
+    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);  // 127.0.0.1
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+        die("connect");
+    }
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    return fd;
+}
+
+static void write_all(int fd, const std::string &buf) {
+    size_t pos = 0;
+    while (pos < buf.size()) {
+        ssize_t rv = write(fd, &buf[pos], buf.size() - pos);
+        if (rv <= 0) {
+            die("write()");
+        }
+        pos += (size_t)rv;
+    }
+}
+
+// 读完n个回复，只看长度不解析内容
+static void read_replies(int fd, std::string &buf, size_t n) {
+    size_t pos = 0;
+    while (n > 0) {
+        if (buf.size() - pos >= 4) {
+            uint32_t len = 0;
+            memcpy(&len, &buf[pos], 4);
+            if (buf.size() - pos >= 4 + len) {
+                pos += 4 + len;
+                n--;
+                continue;
+            }
+        }
+        char tmp[64 * 1024];
+        ssize_t rv = read(fd, tmp, sizeof(tmp));
+        if (rv <= 0) {
+            die("read()");
+        }
+        buf.append(tmp, (size_t)rv);
+    }
+    buf.erase(0, pos);
+}
+
+static void add_req(std::string &out, const std::vector<std::string> &cmd) {
+    uint32_t len = 4;
+    for (const std::string &s : cmd) {
+        len += 4 + s.size();
+    }
+    uint32_t n = cmd.size();
+    out.append((char *)&len, 4);
+    out.append((char *)&n, 4);
+    for (const std::string &s : cmd) {
+        uint32_t sz = s.size();
+        out.append((char *)&sz, 4);
+        out.append(s);
+    }
+}
+
+static std::atomic<bool> g_stop{false};
+static std::atomic<uint64_t> g_done{0};
+
+static void client_main(int id, int nconns, int depth, int nkeys) {
+    std::vector<int> fds;
+    std::vector<std::string> rbufs(nconns);
+    for (int i = 0; i < nconns; ++i) {
+        fds.push_back(connect_server());
+    }
+    uint64_t seed = 0x9E3779B97F4A7C15ull * (id + 1);
+    std::string req;
+    const std::string val(16, 'v');
+    while (!g_stop.load(std::memory_order_relaxed)) {
+        for (int i = 0; i < nconns; ++i) {
+            req.clear();
+            for (int j = 0; j < depth; ++j) {
+                seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+                std::string key = "key:" + std::to_string((seed >> 33) % nkeys);
+                if ((seed >> 20) % 10 == 0) {
+                    add_req(req, {"set", key, val});
+                } else {
+                    add_req(req, {"get", key});
+                }
+            }
+            write_all(fds[i], req);
+        }
+        for (int i = 0; i < nconns; ++i) {
+            read_replies(fds[i], rbufs[i], depth);
+        }
+        g_done.fetch_add((uint64_t)nconns * depth, std::memory_order_relaxed);
+    }
+    for (int fd : fds) {
+        close(fd);
+    }
+}
+
+int main(int argc, char **argv) {
+    int nthreads = argc > 1 ? atoi(argv[1]) : 4;
+    int nconns = argc > 2 ? atoi(argv[2]) : 8;
+    int depth = argc > 3 ? atoi(argv[3]) : 16;
+    int seconds = argc > 4 ? atoi(argv[4]) : 5;
+    int nkeys = argc > 5 ? atoi(argv[5]) : 100000;
+    if (nthreads < 1 || nconns < 1 || depth < 1 || seconds < 1 || nkeys < 1) {
+        fprintf(stderr, "usage: %s [threads] [conns/thread] [depth] [seconds] [nkeys]\n", argv[0]);
+        return 1;
+    }
+
+    // 先把所有key写进去，GET都能命中
+    int fd = connect_server();
+    std::string req, rbuf;
+    for (int i = 0; i < nkeys; ++i) {
+        add_req(req, {"set", "key:" + std::to_string(i), std::string(16, 'v')});
+        if ((i + 1) % 1000 == 0 || i + 1 == nkeys) {
+            write_all(fd, req);
+            read_replies(fd, rbuf, (i % 1000) + 1);
+            req.clear();
+        }
+    }
+    close(fd);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nthreads; ++i) {
+        threads.emplace_back(client_main, i, nconns, depth, nkeys);
+    }
+    uint64_t t0 = now_ns();
+    sleep(seconds);
+    uint64_t done = g_done.load();
+    uint64_t t1 = now_ns();
+    g_stop.store(true);
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    printf("threads=%d conns=%d depth=%d  %.0f req/s\n",
+        nthreads, nthreads * nconns, depth, done * 1e9 / (t1 - t0));
+    return 0;
+}
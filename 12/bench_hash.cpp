@@ -0,0 +1,57 @@
+// usage: bench_hash
+// g++ -O2 bench_hash.cpp -o bench_hash
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include "common.h"
+
+
+// 之前用的FNV，逐字节，只有32位
+static uint64_t fnv_hash(const uint8_t *data, size_t len) {
+    uint32_t h = 0x811C9DC5;
+    for (size_t i = 0; i < len; i++) {
+        h = (h + data[i]) * 0x01000193;
+    }
+    return h;
+}
+
+static uint64_t now_ns() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+const size_t k_nkeys = 1 << 16;     // 所有key加起来能放进L2
+const size_t k_rounds = 200;
+
+template <class F>
+static double bench(F f, const std::vector<uint8_t> &buf, size_t len) {
+    uint64_t sum = 0;
+    uint64_t t0 = now_ns();
+    for (size_t r = 0; r < k_rounds; ++r) {
+        for (size_t i = 0; i < k_nkeys; ++i) {
+            sum += f(&buf[i * len], len);
+        }
+    }
+    uint64_t t1 = now_ns();
+    if (sum == 42) {
+        printf("!");    // 防止被优化掉
+    }
+    return double(t1 - t0) / (k_rounds * k_nkeys);
+}
+
+int main() {
+    g_hash_seed = 0x12345678;
+    printf("len   fnv ns   str_hash ns\n");
+    for (size_t len : {8, 16, 24, 32, 48, 64, 128}) {
+        std::vector<uint8_t> buf(k_nkeys * len);
+        for (uint8_t &c : buf) {
+            c = 'a' + rand() % 26;
+        }
+        double a = bench(fnv_hash, buf, len);
+        double b = bench(str_hash, buf, len);
+        printf("%-5zu %-8.2f %.2f\n", len, a, b);
+    }
+    return 0;
+}
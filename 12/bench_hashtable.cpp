@@ -0,0 +1,255 @@
+// usage: bench_hashtable [hmap|hmapt|smap|batch|resize] [nkeys]
+// g++ -O2 bench_hashtable.cpp hashtable.cpp swisstable.cpp -o bench_hashtable
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hashtable.h"
+#include "swisstable.h"
+
+
+#define container_of(ptr, type, member) ({                  \
+    const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
+    (type *)( (char *)__mptr - offsetof(type, member) );})
+
+
+struct Key {
+    HNode node;
+    uint64_t val = 0;
+};
+
+static bool key_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, Key, node)->val == container_of(rhs, Key, node)->val;
+}
+
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30; x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27; x *= 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+static uint64_t now_ns() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// 两种表用同样的接口跑
+struct HMapOps {
+    HMap m;
+    const char *name() { return "hmap"; }
+    void insert(HNode *node) { hm_insert(&m, node); }
+    HNode *lookup(HNode *key) { return hm_lookup(&m, key, &key_eq); }
+    HNode *pop(HNode *key) { return hm_pop(&m, key, &key_eq); }
+    void clear() { hm_clear(&m); }
+};
+
+// 模板版本，比较函数内联
+struct KeyTr {
+    typedef ::Key T;
+    typedef uint64_t Key;
+    static const size_t offset = offsetof(T, node);
+    static uint64_t hash(uint64_t val) { return mix(val); }
+    static bool eq(T *k, uint64_t val) { return k->val == val; }
+};
+
+struct HMapTOps {
+    HMap m;
+    const char *name() { return "hmapt"; }
+    void insert(HNode *node) { hm_insert(&m, node); }
+    HNode *lookup(HNode *key) {
+        Key *k = hm_lookup<KeyTr>(&m, container_of(key, Key, node)->val, key->hcode);
+        return k ? &k->node : NULL;
+    }
+    HNode *pop(HNode *key) {
+        Key *k = hm_pop<KeyTr>(&m, container_of(key, Key, node)->val, key->hcode);
+        return k ? &k->node : NULL;
+    }
+    void clear() { hm_clear(&m); }
+};
+
+struct SMapOps {
+    SMap m;
+    const char *name() { return "smap"; }
+    void insert(HNode *node) { sm_insert(&m, node); }
+    HNode *lookup(HNode *key) { return sm_lookup(&m, key, &key_eq); }
+    HNode *pop(HNode *key) { return sm_pop(&m, key, &key_eq); }
+    void clear() { sm_clear(&m); }
+};
+
+// 2654435761是质数，n不是它的倍数时 i -> i*p%n 是一个排列
+static size_t shuffle(size_t i, size_t n) {
+    return (size_t)((unsigned __int128)i * 2654435761u % n);
+}
+
+// 按2的幂分桶的耗时分布，返回分位数所在桶的上界
+static uint64_t percentile(const size_t hist[64], size_t n, double p) {
+    size_t want = (size_t)(n * p), acc = 0;
+    for (int i = 0; i < 64; ++i) {
+        acc += hist[i];
+        if (acc > want) {
+            return 1ull << i;
+        }
+    }
+    return ~0ull;
+}
+
+template <class Ops>
+static void bench(Key *keys, size_t n) {
+    Ops ops;
+    // insert, 记录单次操作的耗时分布，看渐进式扩容是否有效
+    size_t hist[64] = {};
+    uint64_t max_ns = 0;
+    uint64_t t0 = now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t s = now_ns();
+        ops.insert(&keys[i].node);
+        uint64_t d = now_ns() - s;
+        max_ns = d > max_ns ? d : max_ns;
+        hist[64 - __builtin_clzll(d | 1)]++;
+    }
+    uint64_t t1 = now_ns();
+
+    // lookup hit, 随机顺序
+    size_t found = 0;
+    for (size_t i = 0; i < n; ++i) {
+        Key *k = &keys[shuffle(i, n)];
+        found += ops.lookup(&k->node) == &k->node;
+    }
+    uint64_t t2 = now_ns();
+    assert(found == n);
+
+    // lookup miss
+    Key miss;
+    for (size_t i = 0; i < n; ++i) {
+        miss.val = n + i;
+        miss.node.hcode = mix(miss.val);
+        found += ops.lookup(&miss.node) != NULL;
+    }
+    uint64_t t3 = now_ns();
+    assert(found == n);
+
+    // 删除一半
+    for (size_t i = 0; i < n; i += 2) {
+        Key *k = &keys[shuffle(i, n)];
+        found -= ops.pop(&k->node) == &k->node;
+    }
+    uint64_t t4 = now_ns();
+    assert(found == n - (n + 1) / 2);
+
+    printf("%s n=%zu insert %.1f ns (p99.99 < %.1f us, max %.1f us)"
+        "  hit %.1f ns  miss %.1f ns  pop %.1f ns\n",
+        ops.name(), n, double(t1 - t0) / n,
+        percentile(hist, n, 0.9999) / 1e3, max_ns / 1e3,
+        double(t2 - t1) / n, double(t3 - t2) / n,
+        double(t4 - t3) / ((n + 1) / 2));
+    ops.clear();
+}
+
+// 随机命中，逐个查找和每16个一批查找对比
+static void bench_batch(Key *keys, size_t n) {
+    const size_t k_batch = 16;
+    HMap m;
+    for (size_t i = 0; i < n; ++i) {
+        hm_insert(&m, &keys[i].node);
+    }
+    while (hm_rehash_step(&m)) {}
+    uint64_t vals[k_batch], hcodes[k_batch];
+    Key *found[k_batch];
+    size_t hit = 0;
+    uint64_t t0 = now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t val = shuffle(i, n);
+        hit += hm_lookup<KeyTr>(&m, val) != NULL;
+    }
+    uint64_t t1 = now_ns();
+    for (size_t i = 0; i + k_batch <= n; i += k_batch) {
+        for (size_t j = 0; j < k_batch; ++j) {
+            vals[j] = shuffle(i + j, n);
+        }
+        hm_lookup_many<KeyTr>(&m, k_batch, vals, hcodes, found);
+        for (size_t j = 0; j < k_batch; ++j) {
+            hit += found[j] != NULL;
+        }
+    }
+    uint64_t t2 = now_ns();
+    assert(hit == n + n / k_batch * k_batch);
+    printf("batch n=%zu single %.1f ns/key  batch of %zu %.1f ns/key\n",
+        n, double(t1 - t0) / n, k_batch, double(t2 - t1) / (n / k_batch * k_batch));
+    hm_clear(&m);
+}
+
+// 单次操作的最长耗时，按它和resize的关系分开统计
+struct ResizeLat {
+    uint64_t start = 0;     // 开始resize(分配新表)的那次操作
+    uint64_t finish = 0;    // 转移完成(释放旧表)的那次操作
+    uint64_t during = 0;    // 其他rehash期间的操作
+    uint64_t idle = 0;      // 没有rehash时的操作
+    void add(HMap &m, bool before, uint64_t d) {
+        bool after = m.ht2.tab != NULL;
+        uint64_t &slot = !before && after ? start : before && !after ? finish
+            : after ? during : idle;
+        slot = d > slot ? d : slot;
+    }
+    void print(const char *what) {
+        printf("%-6s max us: start %.1f  finish %.1f  during %.1f  idle %.1f\n", what,
+            start / 1e3, finish / 1e3, during / 1e3, idle / 1e3);
+    }
+};
+
+// 一直插入到n个key再全部删除，看resize前后的毛刺
+static void bench_resize(Key *keys, size_t n) {
+    HMap m;
+    ResizeLat grow, shrink;
+    for (size_t i = 0; i < n; ++i) {
+        bool before = m.ht2.tab != NULL;
+        uint64_t s = now_ns();
+        hm_insert(&m, &keys[i].node);
+        grow.add(m, before, now_ns() - s);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        bool before = m.ht2.tab != NULL;
+        uint64_t s = now_ns();
+        Key *k = hm_pop<KeyTr>(&m, keys[i].val, keys[i].node.hcode);
+        shrink.add(m, before, now_ns() - s);
+        assert(k == &keys[i]);
+    }
+    grow.print("grow");
+    shrink.print("shrink");
+    hm_destroy(&m);
+}
+
+int main(int argc, char **argv) {
+    const char *which = argc > 1 ? argv[1] : "both";
+    size_t n = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000000;
+    assert(n % 2654435761u != 0);
+
+    Key *keys = new Key[n];
+    for (size_t i = 0; i < n; ++i) {
+        keys[i].val = i;
+        keys[i].node.hcode = mix(i);
+    }
+    if (strcmp(which, "batch") == 0) {
+        bench_batch(keys, n);
+        delete[] keys;
+        return 0;
+    }
+    if (strcmp(which, "resize") == 0) {
+        bench_resize(keys, n);
+        delete[] keys;
+        return 0;
+    }
+    bool all = strcmp(which, "both") == 0;
+    if (all || strcmp(which, "hmap") == 0) {
+        bench<HMapOps>(keys, n);
+    }
+    if (all || strcmp(which, "hmapt") == 0) {
+        bench<HMapTOps>(keys, n);
+    }
+    if (all || strcmp(which, "smap") == 0) {
+        bench<SMapOps>(keys, n);
+    }
+    delete[] keys;
+    return 0;
+}
@@ -0,0 +1,281 @@
+// usage: bench_server [pipeline|alloc] [nreq] [batch]
+// g++ -O2 bench_server.cpp hashtable.cpp zset.cpp uring.cpp -o bench_server -lpthread
+// 在进程内驱动server.cpp的连接处理：请求写进socketpair的一端，
+// 另一端的Conn交给connection_io，不经过事件循环
+#define main server_main
+#include "server.cpp"   // lazy
+#undef main
+
+
+// 数一数malloc调用的次数，operator new也是走malloc
+static std::atomic<uint64_t> g_nalloc{0};
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+extern "C" void *malloc(size_t size) noexcept {
+    g_nalloc.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size) noexcept {
+    g_nalloc.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) noexcept {
+    g_nalloc.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+static void add_req(std::string &out, const std::vector<std::string> &cmd) {
+    uint32_t len = 4;
+    for (const std::string &s : cmd) {
+        len += 4 + s.size();
+    }
+    uint32_t n = cmd.size();
+    out.append((char *)&len, 4);
+    out.append((char *)&n, 4);
+    for (const std::string &s : cmd) {
+        uint32_t sz = s.size();
+        out.append((char *)&sz, 4);
+        out.append(s);
+    }
+}
+
+// 当前线程当作0号分片的事件循环
+static void setup(size_t nshards) {
+    g_conf.backend = BACKEND_POLL;
+    g_keyspace.nshards = nshards;
+    g_keyspace.shards = new Shard[nshards];
+    for (size_t i = 0; i < nshards; ++i) {
+        g_keyspace.shards[i].db.stats = &g_keyspace.shards[i].db_stats;
+        g_keyspace.shards[i].wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    g_data.shard = &g_keyspace.shards[0];
+    dlist_init(&g_data.idle_list);
+}
+
+// 改用io_uring，和run_uring一样注册缓冲区，连接建好后要自己提交recv
+static void setup_uring() {
+    g_conf.backend = BACKEND_URING;
+    if (uring_init(&g_data.ring, k_uring_entries)) {
+        die("io_uring_setup()");
+    }
+    if (uring_setup_buf_ring(
+        &g_data.ring, &g_data.bufs, 0, k_uring_nbufs, k_uring_buf_size))
+    {
+        die("io_uring_register()");
+    }
+}
+
+struct Client {
+    int fd = -1;        // 客户端这一端
+    Conn *conn = NULL;  // 服务端这一端
+    std::string rbuf;
+    size_t nreply = 0;
+};
+
+static Client client_new() {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+        die("socketpair()");
+    }
+    fd_set_nb(sv[1]);
+    Client c;
+    c.fd = sv[1];
+    c.conn = conn_new(sv[0]);
+    if (g_conf.backend == BACKEND_URING) {
+        uring_recv(c.conn);
+    }
+    return c;
+}
+
+// 读走已经发过来的回复，只数个数
+static void client_drain(Client &c) {
+    char tmp[64 * 1024];
+    ssize_t rv = 0;
+    while ((rv = read(c.fd, tmp, sizeof(tmp))) > 0) {
+        c.rbuf.append(tmp, (size_t)rv);
+    }
+    size_t pos = 0;
+    while (c.rbuf.size() - pos >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, &c.rbuf[pos], 4);
+        if (c.rbuf.size() - pos < 4 + len) {
+            break;
+        }
+        pos += 4 + len;
+        c.nreply++;
+    }
+    c.rbuf.erase(0, pos);
+}
+
+// 服务端走一步：poll直接调connection_io，io_uring提交并处理已经完成的事件
+static void server_step(Client &c) {
+    if (g_conf.backend != BACKEND_URING) {
+        connection_io(c.conn);
+        assert(c.conn->state != STATE_END);
+        return;
+    }
+    if (uring_submit_and_wait(&g_data.ring, 0, 0) < 0) {
+        die("io_uring_enter");
+    }
+    while (io_uring_cqe *cqe = uring_peek_cqe(&g_data.ring)) {
+        io_uring_cqe copy = *cqe;
+        uring_cqe_seen(&g_data.ring);
+        uring_on_cqe(-1, &copy);
+    }
+    assert(c.conn->state != STATE_END);
+}
+
+// 发一批请求，让服务端处理到全部回复为止
+static void client_run(Client &c, const std::string &reqs, size_t n) {
+    size_t sent = 0;
+    size_t want = c.nreply + n;
+    while (c.nreply < want) {
+        if (sent < reqs.size()) {
+            ssize_t rv = write(c.fd, &reqs[sent], reqs.size() - sent);
+            sent += rv > 0 ? (size_t)rv : 0;
+        }
+        server_step(c);
+        shard_wake();
+        client_drain(c);
+        std::this_thread::yield();  // 让其他分片的线程执行转发过去的命令
+    }
+}
+
+// 旧的做法：rbuf固定4+4096字节，每处理完一个请求就把剩下的数据搬到开头
+static uint64_t old_moved(const std::string &stream) {
+    const size_t cap = 4 + 4096;
+    size_t size = 0, pos = 0;
+    uint64_t moved = 0;
+    while (pos < stream.size() || size > 0) {
+        size_t n = stream.size() - pos < cap - size ? stream.size() - pos : cap - size;
+        pos += n;
+        size += n;
+        while (size >= 4) {
+            uint32_t len = 0;
+            memcpy(&len, &stream[pos - size], 4);
+            if (size < 4 + len) {
+                break;
+            }
+            size -= 4 + len;
+            moved += size;
+        }
+    }
+    return moved;
+}
+
+// 一个连接，每批batch个GET流水线发送，统计rbuf搬动的字节数。
+// value大的时候回复发得慢，请求在rbuf里积压得多。
+// 旧的做法只对read()路径有意义，io_uring只输出现在的数字
+static void bench_pipeline(size_t nreq, size_t batch, size_t vlen, bool uring) {
+    Client c = client_new();
+    std::string reqs;
+    add_req(reqs, {"set", "key", std::string(vlen, 'v')});
+    client_run(c, reqs, 1);
+
+    reqs.clear();
+    for (size_t i = 0; i < batch; ++i) {
+        add_req(reqs, {"get", "key"});
+    }
+    uint64_t moved = g_data.rbuf_moved;
+    uint64_t old = 0;
+    for (size_t done = 0; done < nreq; done += batch) {
+        client_run(c, reqs, batch);
+        old += old_moved(reqs);
+    }
+    moved = g_data.rbuf_moved - moved;
+    printf("pipeline %s %zu GETs (%zu B each, value %zu B), batch %zu\n",
+        uring ? "uring" : "poll", nreq, reqs.size() / batch, vlen, batch);
+    if (uring) {
+        printf("  memmove per request: %.2f B\n", (double)moved / nreq);
+    } else {
+        printf("  memmove per request: %.1f B before (replayed), %.2f B now\n",
+            (double)old / nreq, (double)moved / nreq);
+    }
+    conn_done(c.conn);
+    close(c.fd);
+}
+
+static std::atomic<bool> g_stop{false};
+
+// 其他分片的事件循环，只处理转发过来的命令
+static void shard_main(size_t id) {
+    g_data.shard = &g_keyspace.shards[id];
+    while (!g_stop.load()) {
+        shard_serve();
+        std::this_thread::yield();
+    }
+}
+
+// 预热之后每个GET的malloc次数，nshards > 1时大约一半的GET转发给1号分片
+static bool bench_alloc(size_t nreq, size_t batch, size_t nshards, size_t vlen) {
+    g_stop.store(false);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nshards; ++i) {
+        threads.emplace_back(shard_main, i);
+    }
+    Client c = client_new();
+    const size_t nkeys = 64;
+    std::string reqs;
+    for (size_t i = 0; i < nkeys; ++i) {
+        add_req(reqs, {"set", "k" + std::to_string(i), std::string(vlen, 'v')});
+    }
+    client_run(c, reqs, nkeys);
+
+    reqs.clear();
+    for (size_t i = 0; i < batch; ++i) {
+        add_req(reqs, {"get", "k" + std::to_string(i % nkeys)});
+    }
+    // 让缓冲区、池子和临时空间都长到够用
+    for (int i = 0; i < 3; ++i) {
+        client_run(c, reqs, batch);
+    }
+    uint64_t before = g_nalloc.load();
+    for (size_t done = 0; done < nreq; done += batch) {
+        client_run(c, reqs, batch);
+    }
+    uint64_t nalloc = g_nalloc.load() - before;
+
+    g_stop.store(true);
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    conn_done(c.conn);
+    close(c.fd);
+    printf("alloc shards=%zu value=%zu B: %.3f malloc/GET\n",
+        nshards, vlen, (double)nalloc / nreq);
+    return nalloc == 0;
+}
+
+int main(int argc, char **argv) {
+    const char *which = argc > 1 ? argv[1] : "pipeline";
+    size_t nreq = argc > 2 ? strtoull(argv[2], NULL, 10) : 100000;
+    size_t batch = argc > 3 ? strtoull(argv[3], NULL, 10) : 1000;
+    if (strcmp(which, "pipeline") == 0) {
+        setup(1);
+        for (size_t vlen : {8, 1000}) {
+            bench_pipeline(nreq, batch, vlen, false);
+        }
+        setup_uring();
+        for (size_t vlen : {8, 1000}) {
+            bench_pipeline(nreq, batch, vlen, true);
+        }
+    }
+    if (strcmp(which, "alloc") == 0) {
+        // GET不应该分配内存，有分配就返回失败
+        setup(2);
+        bool ok = true;
+        for (size_t nshards = 1; nshards <= 2; ++nshards) {
+            g_keyspace.nshards = nshards;
+            for (size_t vlen : {8, 100, 2000}) {
+                ok = bench_alloc(nreq, batch, nshards, vlen) && ok;
+            }
+        }
+        return ok ? 0 : 1;
+    }
+    return 0;
+}
@@ -0,0 +1,219 @@
+// usage: bench_zset [remrange|index|small] [nkeys]
+// g++ -O2 bench_zset.cpp hashtable.cpp zbtree.cpp -o bench_zset
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <vector>
+#include "zset.cpp"     // lazy, 要用到里面的tree_add
+#include "zbtree.h"
+
+
+static uint64_t now_ns() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static void fill(ZSet *z, size_t n) {
+    char name[32];
+    for (size_t i = 0; i < n; ++i) {
+        int len = snprintf(name, sizeof(name), "member:%zu", i);
+        zset_add(z, name, len, (double)((i * 2654435761u) % n));
+    }
+}
+
+// 删掉中间的k个元素：逐个zset_pop，和split/join一次摘下再分批释放
+static void bench_remrange(size_t n, uint64_t k) {
+    uint64_t start = (n - k) / 2, stop = start + k;
+
+    ZSet a;
+    fill(&a, n);
+    uint64_t t0 = now_ns();
+    for (uint64_t i = start; i < stop; ++i) {
+        size_t len = 0;
+        const char *name = zit_name(zset_at(&a, start), &len);
+        zset_rem(&a, name, len);
+    }
+    uint64_t t1 = now_ns();
+    assert(zset_size(&a) == n - (stop - start));
+    zset_dispose(&a);
+
+    ZSet b;
+    fill(&b, n);
+    uint64_t t2 = now_ns();
+    AVLNode *garbage = zset_rem_range(&b, start, stop);
+    uint64_t t3 = now_ns();
+    uint64_t max_batch = 0;
+    while (garbage) {
+        uint64_t s = now_ns();
+        zset_free_some(&garbage, 1024);
+        uint64_t d = now_ns() - s;
+        max_batch = d > max_batch ? d : max_batch;
+    }
+    uint64_t t4 = now_ns();
+    assert(zset_size(&b) == n - (stop - start));
+    zset_dispose(&b);
+
+    printf("remrange n=%zu k=%zu  pop each %.1f ms  split/join %.1f ms"
+        " + free %.1f ms (max batch %.1f us)\n",
+        n, (size_t)(stop - start), (t1 - t0) / 1e6, (t3 - t2) / 1e6,
+        (t4 - t3) / 1e6, max_batch / 1e3);
+}
+
+// 2654435761是质数，n不是它的倍数时 i -> i*p%n 是一个排列
+static size_t shuffle(size_t i, size_t n) {
+    return (size_t)((unsigned __int128)i * 2654435761u % n);
+}
+
+// 所有ZNode放在一整块内存里，名字固定8字节，50M个也能放下
+const size_t k_slab_node = sizeof(ZNode) + 8;
+
+static ZNode *slab_node(char *slab, size_t i) {
+    return (ZNode *)(slab + i * k_slab_node);
+}
+
+static uint64_t bt_bytes(BNode *node) {
+    if (node->leaf) {
+        return sizeof(BLeaf);
+    }
+    uint64_t bytes = sizeof(BInner);
+    for (uint32_t i = 0; i < node->n; ++i) {
+        bytes += bt_bytes(((BInner *)node)->child[i]);
+    }
+    return bytes;
+}
+
+const size_t k_nquery = 1000000;
+const size_t k_query_limit = 10;    // 每次ZQUERY取的元素个数
+const size_t k_nscan = 1000;
+const size_t k_scan_limit = 1000;
+
+// 同一批ZNode，AVL树和B+树各建一遍索引，只比较索引本身：
+// 随机顺序插入，ZQUERY(从一个分数开始取10个)，长一点的范围扫描
+static void bench_index(size_t n) {
+    char *slab = (char *)malloc(n * k_slab_node);
+    assert(slab);
+    for (size_t i = 0; i < n; ++i) {
+        ZNode *node = slab_node(slab, i);
+        node->score = (double)shuffle(i, n);
+        node->len = 8;
+        memcpy(node->name, &i, 8);
+    }
+    std::vector<double> qscore(k_nquery);
+    for (size_t i = 0; i < k_nquery; ++i) {
+        qscore[i] = (double)shuffle(i * 7919, n);
+    }
+
+    ZSet z;
+    zset_to_tree(&z);
+    uint64_t t0 = now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        ZNode *node = slab_node(slab, i);
+        avl_init(&node->tree);
+        tree_add(&z, node);
+    }
+    uint64_t t1 = now_ns();
+    uint64_t sum = 0;
+    for (size_t i = 0; i < k_nquery; ++i) {
+        ZNode *node = container_of(tree_seek(&z, qscore[i], "", 0), ZNode, tree);
+        for (size_t j = 0; node && j < k_query_limit; ++j) {
+            sum += node->len;
+            node = container_of(avl_offset(&node->tree, +1), ZNode, tree);
+        }
+    }
+    uint64_t t2 = now_ns();
+    for (size_t i = 0; i < k_nscan; ++i) {
+        ZNode *node = container_of(tree_seek(&z, qscore[i], "", 0), ZNode, tree);
+        for (size_t j = 0; node && j < k_scan_limit; ++j) {
+            sum += node->len;
+            node = container_of(avl_offset(&node->tree, +1), ZNode, tree);
+        }
+    }
+    uint64_t t3 = now_ns();
+    printf("avl   n=%zu insert %.0f ns  zquery %.0f ns  scan %.1f ns/elem  index %.1f B/elem\n",
+        n, double(t1 - t0) / n, double(t2 - t1) / k_nquery,
+        double(t3 - t2) / (k_nscan * k_scan_limit), (double)sizeof(AVLNode));
+
+    BTree bt;
+    t0 = now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        bt_insert(&bt, slab_node(slab, i));
+    }
+    t1 = now_ns();
+    uint64_t rank = 0;
+    for (size_t i = 0; i < k_nquery; ++i) {
+        BIter it = bt_seek(&bt, qscore[i], "", 0, &rank);
+        for (size_t j = 0; it.leaf && j < k_query_limit; ++j) {
+            sum -= bt_get(it)->len;
+            it = bt_next(it);
+        }
+    }
+    t2 = now_ns();
+    for (size_t i = 0; i < k_nscan; ++i) {
+        BIter it = bt_seek(&bt, qscore[i], "", 0, &rank);
+        for (size_t j = 0; it.leaf && j < k_scan_limit; ++j) {
+            sum -= bt_get(it)->len;
+            it = bt_next(it);
+        }
+    }
+    t3 = now_ns();
+    assert(sum == 0);   // 两边取到的元素一样多
+    printf("btree n=%zu insert %.0f ns  zquery %.0f ns  scan %.1f ns/elem  index %.1f B/elem\n",
+        n, double(t1 - t0) / n, double(t2 - t1) / k_nquery,
+        double(t3 - t2) / (k_nscan * k_scan_limit), (double)bt_bytes(bt.root) / n);
+    bt_clear(&bt);
+    delete z.big;   // 节点在slab里
+    free(slab);
+}
+
+static size_t heap_used() {
+    return mallinfo2().uordblks;
+}
+
+// n个小zset，每个m个元素，紧凑编码和直接转成tree各占多少堆内存。
+// 和server里一样每个ZSet都new出来，头部本身也算在内
+static void bench_small(size_t n, size_t m) {
+    for (int big = 0; big < 2; ++big) {
+        std::vector<ZSet *> zs(n);
+        size_t before = heap_used();
+        char name[32];
+        for (size_t i = 0; i < n; ++i) {
+            zs[i] = new ZSet();
+            for (size_t j = 0; j < m; ++j) {
+                int len = snprintf(name, sizeof(name), "member:%zu", j);
+                zset_add(zs[i], name, len, (double)((i + j * 7) % m));
+            }
+            if (big) {
+                zset_to_tree(zs[i]);
+            }
+        }
+        size_t bytes = heap_used() - before;
+        printf("small m=%zu %s %.1f B/zset (sizeof(ZSet) %zu)\n",
+            m, big ? "tree" : "pack", (double)bytes / n, sizeof(ZSet));
+        for (ZSet *z : zs) {
+            zset_dispose(z);
+            delete z;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *which = argc > 1 ? argv[1] : "remrange";
+    size_t n = argc > 2 ? strtoull(argv[2], NULL, 10) : 1200000;
+    if (strcmp(which, "remrange") == 0) {
+        bench_remrange(n, n / 6);       // 删掉的少，逐个摘hmap
+        bench_remrange(n, n - n / 6);   // 剩下的少，重建hmap
+    }
+    if (strcmp(which, "index") == 0) {
+        bench_index(n);
+    }
+    if (strcmp(which, "small") == 0) {
+        for (size_t m : {1, 5, 20, 128}) {
+            bench_small(n / m, m);
+        }
+    }
+    return 0;
+}
@@ -1,18 +1,20 @@
 #pragma once
 #include <stddef.h>
 #include <stdint.h>
+#include "wyhash.h"
 
 #define container_of(ptr, type, member) ({                  \
     const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
     (type *)( (char *)__mptr - offsetof(type, member) );})
 
 
+// 每个进程启动时随机生成，防止有人构造大量冲突的key
+// 必须在计算任何hash之前设置好，之后只读
+inline uint64_t g_hash_seed = 0;
+
+// 一次处理8字节，结果是完整的64位
 inline uint64_t str_hash(const uint8_t *data, size_t len) {
-    uint32_t h = 0x811C9DC5;
-    for (size_t i = 0; i < len; i++) {
-        h = (h + data[i]) * 0x01000193;
-    }
-    return h;
+    return wyhash(data, len, g_hash_seed, _wyp);
 }
 
 
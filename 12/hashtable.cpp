@@ -1,10 +1,43 @@
 #include "hashtable.h"
 #include <assert.h>
 #include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+
+// 大的桶数组直接mmap，页面在第一次访问时才分配并清零，开始resize的那次
+// 操作不用清零整个数组。malloc的mmap阈值是动态的，calloc不能保证这一点
+const size_t k_mmap_min = 1 << 20;
+// 旧表按这个粒度在转移过程中逐步归还
+const size_t k_release_chunk = 2 << 20;
+
+static bool h_is_mmap(size_t n){
+    return n * sizeof(HNode *) >= k_mmap_min;
+}
+
+static HNode **h_alloc(size_t n){
+    if(!h_is_mmap(n)){
+        return (HNode **)calloc(n, sizeof(HNode *));
+    }
+    size_t bytes = n * sizeof(HNode *);
+    void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(p != MAP_FAILED);
+    // 不加MADV_HUGEPAGE：新表的插入是随机的，每次缺页都要清零2MB，
+    // 开始resize的那次操作反而更慢
+    return (HNode **)p;
+}
+
+static void h_free(HTab *htab){
+    if(htab->tab && h_is_mmap(htab->mask + 1)){
+        munmap(htab->tab, (htab->mask + 1) * sizeof(HNode *));
+    }else{
+        free(htab->tab);
+    }
+}
 
 static void h_init(HTab *htab, size_t n){
     assert((n > 0) && ((n - 1) & n) == 0);  // 确保是2的幂
-    htab->tab = (HNode **)calloc(n, sizeof(HNode *));
+    htab->tab = h_alloc(n);
     htab->mask = n - 1;
     htab->size = 0;
 }
@@ -17,106 +50,202 @@ static void h_insert(HTab *htab, HNode *node){
     htab->size++;
 }
 
-// search key
-static HNode **h_lookup(HTab *htab, HNode *key, bool (*cmp)(HNode*,HNode*)){
-    if(!htab->tab)  return NULL;
-    size_t pos = htab->mask & key->hcode;
-    HNode **from = &htab->tab[pos];
-    while(*from){
-        if(cmp(*from, key)){
-            return from;
-        }
-        from = &(*from)->next;
+// 函数指针接口: key本身就是一个HNode，比较函数在运行时才知道
+struct HNodeKey{
+    HNode *node;
+    bool (*cmp)(HNode *, HNode *);
+};
+
+struct HNodeTr{
+    typedef HNode T;
+    typedef HNodeKey Key;
+    static const size_t offset = 0;
+    static bool eq(HNode *node, const HNodeKey &key){
+        return key.cmp(node, key.node);
     }
-    return NULL;
-}
-// delete *from and return it
-static HNode *h_detach(HTab *htab, HNode **from){
-    HNode *node = *from;
-    (*from) = (*from)->next;
-    htab->size--;
-    return node;
-}
+};
 
 // 一轮最多转移128个key
-const int k_resizing_work = 128;
+const size_t k_resizing_work = 128;
+// 空桶只需要读一个指针，但缩小之后旧表很稀疏，也要限制一轮跳过的数量
+const size_t k_resizing_empty = 1024;
+
+static uint64_t get_monotonic_nsec(){
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
 
 // 由ht2转移到ht1
-static void hm_help_resizing(HMap *hmap){
-    if(hmap->ht2.tab == NULL){
-        return;
-    }
+void hm_resizing_work(HMap *hmap){
+    HStats *stats = hmap->stats;
+    uint64_t start = stats ? get_monotonic_nsec() : 0;
+    size_t pos0 = hmap->resizing_pos;
     size_t nwork = 0;
-    while(nwork < k_resizing_work && hmap->ht2.size > 0){
+    size_t nempty = 0;
+    while(nwork < k_resizing_work && nempty < k_resizing_empty
+        && hmap->ht2.size > 0)
+    {
         HNode ** from = &hmap->ht2.tab[hmap->resizing_pos];
         if(!*from){
             hmap->resizing_pos++;
+            nempty++;
             continue;
         }
         h_insert(&hmap->ht1, h_detach(&hmap->ht2, from));
         nwork++;
     }
     // 清理内存
-    if(hmap->ht2.size == 0){
-        free(hmap->ht2.tab);
+    bool done = hmap->ht2.size == 0;
+    if(done){
+        h_free(&hmap->ht2);
         hmap->ht2 = HTab{};
+    }else if(h_is_mmap(hmap->ht2.mask + 1)){
+        // 已经整段转移完的桶都是空的，先把物理页还掉，不必等到最后一次性释放。
+        // 之后查找读到的是零页，仍然是空桶
+        size_t lo = pos0 * sizeof(HNode *) / k_release_chunk;
+        size_t hi = hmap->resizing_pos * sizeof(HNode *) / k_release_chunk;
+        if(lo < hi){
+            (void)madvise((char *)hmap->ht2.tab + lo * k_release_chunk,
+                (hi - lo) * k_release_chunk, MADV_DONTNEED);
+        }
+    }
+    if(stats){
+        uint64_t now = get_monotonic_nsec();
+        stats->resize_ns += now - start;
+        if(now - start > stats->max_resize_step_ns){
+            stats->max_resize_step_ns = now - start;
+        }
+        if(done){
+            stats->last_resize_ns = now - stats->resize_start_ns;
+        }
     }
 }
-// 决定是否需要转移
-static void hm_start_resizing(HMap *hmap){
+// 换成n个桶的新表，旧表的节点逐步转移过去，扩大和缩小都是这个流程
+static void hm_start_resizing(HMap *hmap, size_t n){
     assert(hmap->ht2.tab == NULL);
-    // create a bigger tab
     hmap->ht2 = hmap->ht1;
-    // 2 times
-    h_init(&hmap->ht1, (hmap->ht1.mask + 1) << 1);
+    h_init(&hmap->ht1, n);
     hmap->resizing_pos = 0;
+    if(hmap->stats){
+        hmap->stats->resizes++;
+        hmap->stats->resize_start_ns = get_monotonic_nsec();
+    }
 }
 
 // 寻找一个节点
 HNode* hm_lookup(HMap* hmap, HNode *key,bool(*cmp)(HNode*,HNode*)){
-    hm_help_resizing(hmap);
-    HNode **from = h_lookup(&hmap->ht1, key, cmp);
-    if(!from){
-        from = h_lookup(&hmap->ht2, key, cmp);
+    return hm_lookup<HNodeTr>(hmap, HNodeKey{key, cmp}, key->hcode);
+}
+// 装载因子低于1时缩小到装载因子4左右，和扩容的阈值8之间留出余量，避免来回抖动
+const size_t k_min_buckets = 4;
+void hm_check_shrink(HMap *hmap){
+    size_t n = hmap->ht1.mask + 1;
+    if(hmap->ht2.tab || n <= k_min_buckets || hmap->ht1.size >= n){
+        return;
+    }
+    size_t target = k_min_buckets;
+    while(target * 4 < hmap->ht1.size){
+        target <<= 1;
     }
-    return from ? *from : NULL;
+    hm_start_resizing(hmap, target);
 }
+
 // 删除一个节点
 HNode* hm_pop(HMap* hmap, HNode *key, bool(*cmp)(HNode*,HNode*)){
-    hm_help_resizing(hmap);
-    HNode ** from =  h_lookup(&hmap->ht1,key,cmp);
-    if(from){
-        return h_detach(&hmap->ht1,from);
-    }
-    from = h_lookup(&hmap->ht2, key, cmp);
-    if(from){
-        return h_detach(&hmap->ht2,from);
-    }
-    return NULL;
+    return hm_pop<HNodeTr>(hmap, HNodeKey{key, cmp}, key->hcode);
 }
 
 // 插入节点
 const size_t k_max_load_factor = 8;
 void hm_insert(HMap *hmap, HNode *node){
     if(!hmap->ht1.tab){
-        h_init(&hmap->ht1, 4);
+        h_init(&hmap->ht1, k_min_buckets);
     }
     h_insert(&hmap->ht1, node);
     if(!hmap->ht2.tab){
         // check whether we need to resize
         size_t load_factor = hmap->ht1.size / (hmap->ht1.mask + 1);
         if (load_factor >= k_max_load_factor) {
-            hm_start_resizing(hmap);
+            // 2 times
+            hm_start_resizing(hmap, (hmap->ht1.mask + 1) << 1);
         }
     }
     hm_help_resizing(hmap);
 }
 void hm_destroy(HMap *hmap){
     assert(hmap->ht1.size + hmap->ht2.size == 0);
-    free(hmap->ht1.tab);
-    free(hmap->ht2.tab);
+    h_free(&hmap->ht1);
+    h_free(&hmap->ht2);
+    HStats *stats = hmap->stats;
     *hmap = HMap{};
+    hmap->stats = stats;
+}
+// 节点由调用方自行释放，这里只丢弃桶数组
+void hm_clear(HMap *hmap){
+    h_free(&hmap->ht1);
+    h_free(&hmap->ht2);
+    HStats *stats = hmap->stats;
+    *hmap = HMap{};
+    hmap->stats = stats;
 }
 size_t hm_size(HMap *hmap){
     return hmap->ht1.size + hmap->ht2.size;
-}
\ No newline at end of file
+}
+bool hm_rehash_step(HMap *hmap){
+    hm_help_resizing(hmap);
+    return hmap->ht2.tab != NULL;
+}
+size_t hm_rehash_left(HMap *hmap){
+    return hmap->ht2.size;
+}
+static uint64_t rev_bits(uint64_t v){
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+    return __builtin_bswap64(v);
+}
+
+// 在mask之内按反向二进制加1: 高位先变，表大小翻倍或减半之后
+// 已经访问过的桶展开/合并后仍然都在游标前面
+static uint64_t rev_next(uint64_t v, size_t mask){
+    v |= ~(uint64_t)mask;
+    v = rev_bits(v);
+    v++;
+    return rev_bits(v);
+}
+
+static void h_scan_bucket(HTab *htab, uint64_t v, void (*f)(HNode *, void *), void *arg){
+    HNode *node = htab->tab[v & htab->mask];
+    while(node){
+        HNode *next = node->next;
+        f(node, arg);
+        node = next;
+    }
+}
+
+uint64_t hm_scan(
+    HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg)
+{
+    HTab *t0 = &hmap->ht1;
+    HTab *t1 = &hmap->ht2;
+    if(!t0->tab){
+        return 0;
+    }
+    if(!t1->tab){
+        h_scan_bucket(t0, cursor, f, arg);
+        return rev_next(cursor, t0->mask);
+    }
+    // rehash期间: 先访问小表的桶，再访问大表里由它展开的所有桶
+    if(t0->mask > t1->mask){
+        HTab *tmp = t0;
+        t0 = t1;
+        t1 = tmp;
+    }
+    h_scan_bucket(t0, cursor, f, arg);
+    do{
+        h_scan_bucket(t1, cursor, f, arg);
+        cursor = rev_next(cursor, t1->mask);
+    }while(cursor & (t0->mask ^ t1->mask));
+    return cursor;
+}
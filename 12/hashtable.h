@@ -13,15 +13,225 @@ struct HTab{
     size_t size = 0;
 };
 
+// 查找比较过的节点数按 0, 1, 2, 3-4, 5-8, 9-16, 17+ 分桶
+const size_t k_probe_hist = 7;
+
+// 可选的统计，只有需要观察的表才挂上(HMap::stats不为空)
+struct HStats{
+    uint64_t lookups = 0;           // 查找和删除的次数
+    uint64_t probes = 0;            // 比较过的节点总数
+    uint64_t max_probes = 0;        // 单次查找最多比较的节点数
+    uint64_t probe_hist[k_probe_hist] = {};
+    uint64_t resizes = 0;           // 开始过的resize次数
+    uint64_t resize_ns = 0;         // 转移节点花的总时间
+    uint64_t max_resize_step_ns = 0;
+    uint64_t resize_start_ns = 0;
+    uint64_t last_resize_ns = 0;    // 上一次resize从开始到完成
+};
+
 // it uses 2 hashtables for progressive resizing
 struct HMap{
     HTab ht1;
     HTab ht2;
     size_t resizing_pos = 0;
+    HStats *stats = NULL;
 };
 
 HNode* hm_lookup(HMap* hmap, HNode *key,bool(*cmp)(HNode*,HNode*));
 HNode* hm_pop(HMap* hmap, HNode *key, bool(*cmp)(HNode*,HNode*));
 void hm_insert(HMap *hmap, HNode *node);
 void hm_destroy(HMap *hmap);
+void hm_clear(HMap *hmap);
 size_t hm_size(HMap *hmap);
+// 不依赖于增删查，单独推进一步渐进式rehash，返回是否还没完成
+bool hm_rehash_step(HMap *hmap);
+// 还留在旧表里等待转移的节点数
+size_t hm_rehash_left(HMap *hmap);
+// 无状态的游标遍历，每次访问一个桶(rehash期间还有它在另一个表里对应的桶)
+// 返回下一个游标，0表示遍历完成。表在两次调用之间扩大缩小也不会漏掉节点
+uint64_t hm_scan(
+    HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg);
+
+// 下面是模板版本的查找和删除，比较函数在编译期确定，能内联进遍历链表的循环
+// Tr需要提供:
+//   T                          包含HNode的类型
+//   Key                        查找用的key
+//   offset                     HNode在T中的偏移
+//   uint64_t hash(const Key &)
+//   bool eq(T *, const Key &)  hcode相同之后才调用
+// 上面的函数指针接口也是它的一个实例
+
+// 转移一部分旧表的节点，只在rehash期间调用
+void hm_resizing_work(HMap *hmap);
+// 删除之后检查是否要缩小
+void hm_check_shrink(HMap *hmap);
+
+inline void hm_help_resizing(HMap *hmap){
+    if(hmap->ht2.tab){
+        hm_resizing_work(hmap);
+    }
+}
+
+template <class Tr>
+inline typename Tr::T *h_owner(HNode *node){
+    return (typename Tr::T *)((char *)node - Tr::offset);
+}
+
+inline void hs_probe(HStats *stats, size_t probes){
+    stats->lookups++;
+    stats->probes += probes;
+    if(probes > stats->max_probes){
+        stats->max_probes = probes;
+    }
+    size_t i = probes <= 2 ? probes : 65 - __builtin_clzll(probes - 1);
+    stats->probe_hist[i < k_probe_hist ? i : k_probe_hist - 1]++;
+}
+
+// probes累加比较过的节点数
+template <class Tr>
+inline HNode **h_lookup(
+    HTab *htab, const typename Tr::Key &key, uint64_t hcode, size_t &probes)
+{
+    if(!htab->tab){
+        return NULL;
+    }
+    HNode **from = &htab->tab[htab->mask & hcode];
+    for(HNode *cur; (cur = *from) != NULL; from = &cur->next){
+        probes++;
+        if(cur->hcode == hcode && Tr::eq(h_owner<Tr>(cur), key)){
+            return from;
+        }
+    }
+    return NULL;
+}
+
+// delete *from and return it
+inline HNode *h_detach(HTab *htab, HNode **from){
+    HNode *node = *from;
+    *from = node->next;
+    htab->size--;
+    return node;
+}
+
+// 调用方已经算好hash时可以直接传进来
+template <class Tr>
+typename Tr::T *hm_lookup(HMap *hmap, const typename Tr::Key &key, uint64_t hcode){
+    hm_help_resizing(hmap);
+    size_t probes = 0;
+    HNode **from = h_lookup<Tr>(&hmap->ht1, key, hcode, probes);
+    if(!from){
+        from = h_lookup<Tr>(&hmap->ht2, key, hcode, probes);
+    }
+    if(hmap->stats){
+        hs_probe(hmap->stats, probes);
+    }
+    return from ? h_owner<Tr>(*from) : NULL;
+}
+
+template <class Tr>
+typename Tr::T *hm_lookup(HMap *hmap, const typename Tr::Key &key){
+    return hm_lookup<Tr>(hmap, key, Tr::hash(key));
+}
+
+template <class Tr>
+typename Tr::T *hm_pop(HMap *hmap, const typename Tr::Key &key, uint64_t hcode){
+    hm_help_resizing(hmap);
+    size_t probes = 0;
+    HNode *node = NULL;
+    HNode **from = h_lookup<Tr>(&hmap->ht1, key, hcode, probes);
+    if(from){
+        node = h_detach(&hmap->ht1, from);
+    }else if((from = h_lookup<Tr>(&hmap->ht2, key, hcode, probes))){
+        node = h_detach(&hmap->ht2, from);
+    }
+    if(hmap->stats){
+        hs_probe(hmap->stats, probes);
+    }
+    if(!node){
+        return NULL;
+    }
+    hm_check_shrink(hmap);
+    return h_owner<Tr>(node);
+}
+
+template <class Tr>
+typename Tr::T *hm_pop(HMap *hmap, const typename Tr::Key &key){
+    return hm_pop<Tr>(hmap, key, Tr::hash(key));
+}
+
+// 批量查找时同时在走的链表数，预取的数据要能留在L1里
+const size_t k_lookup_batch = 16;
+
+inline HNode *h_bucket(HTab *htab, uint64_t hcode){
+    return htab->tab ? htab->tab[hcode & htab->mask] : NULL;
+}
+
+// 批量查找n个key，hcodes返回每个key的hash，out返回查找结果
+// 先算出所有hash并预取桶，然后所有链表同步往前走，每一步都先预取
+// 下一个节点，这样各个key的内存访问是重叠的，而不是一个接一个地等
+template <class Tr>
+void hm_lookup_many(HMap *hmap, size_t n, const typename Tr::Key *keys,
+    uint64_t *hcodes, typename Tr::T **out)
+{
+    hm_help_resizing(hmap);
+    HTab *t1 = &hmap->ht1;
+    HTab *t2 = &hmap->ht2;
+    HNode *cur[k_lookup_batch];
+    bool in_t2[k_lookup_batch];
+    size_t probes[k_lookup_batch];
+    for(size_t base = 0; base < n; base += k_lookup_batch){
+        size_t m = n - base < k_lookup_batch ? n - base : k_lookup_batch;
+        const typename Tr::Key *key = &keys[base];
+        uint64_t *hcode = &hcodes[base];
+        for(size_t i = 0; i < m; ++i){
+            hcode[i] = Tr::hash(key[i]);
+            if(t1->tab){
+                __builtin_prefetch(&t1->tab[hcode[i] & t1->mask]);
+            }
+            if(t2->tab){
+                __builtin_prefetch(&t2->tab[hcode[i] & t2->mask]);
+            }
+        }
+        for(size_t i = 0; i < m; ++i){
+            out[base + i] = NULL;
+            probes[i] = 0;
+            cur[i] = h_bucket(t1, hcode[i]);
+            in_t2[i] = !cur[i];
+            if(!cur[i]){
+                cur[i] = h_bucket(t2, hcode[i]);
+            }
+            if(cur[i]){
+                __builtin_prefetch(cur[i]);
+            }
+        }
+        bool active = true;
+        while(active){
+            active = false;
+            for(size_t i = 0; i < m; ++i){
+                HNode *node = cur[i];
+                if(!node){
+                    continue;
+                }
+                probes[i]++;
+                if(node->hcode == hcode[i] && Tr::eq(h_owner<Tr>(node), key[i])){
+                    out[base + i] = h_owner<Tr>(node);
+                    cur[i] = NULL;
+                    continue;
+                }
+                node = node->next;
+                if(!node && !in_t2[i]){
+                    in_t2[i] = true;
+                    node = h_bucket(t2, hcode[i]);
+                }
+                if(node){
+                    __builtin_prefetch(node);
+                    active = true;
+                }
+                cur[i] = node;
+            }
+        }
+        for(size_t i = 0; i < m && hmap->stats; ++i){
+            hs_probe(hmap->stats, probes[i]);
+        }
+    }
+}
@@ -9,20 +9,27 @@
 #include <sys/socket.h>
 #include <netinet/ip.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <malloc.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <atomic>
+#include <thread>
 #include <math.h>
 #include "hashtable.h"
 #include "zset.h"
 #include "list.h"
+#include "uring.h"
+#include "common.h"
 
-// 侵入式 通过HNode指针找到Entry指针
-#define container_of(ptr, type, member) ({                  \
-    const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
-    (type *)( (char *)__mptr - offsetof(type, member) );})
-
-const size_t k_max_msg = 4096;
+const size_t k_max_args = 200 * 1000;
 // 返回状态
 enum{
     STATE_REQ = 0,  // 读取请求,其实也是初始状态，接收客户端数据
@@ -30,15 +37,6 @@ enum{
     STATE_END = 2,  // 将删除此连接  
 };
 
-// 序列化
-enum{
-    SER_NIL = 0, // like null
-    SER_ERR = 1, // an error code and msg
-    SER_STR = 2, // a string
-    SER_INT = 3, // a int 64
-    SER_DBL = 4,
-    SER_ARR = 5, // array
-};
 // 错误类型
 enum {
     ERR_UNKNOWN = 1,
@@ -47,26 +45,168 @@ enum {
     ERR_ARG = 4,
 };
 
+// 引用计数的value，写入后不再修改
+// GET回复直接引用它发送，在发送完成之前由连接持有一份引用
+struct Val{
+    std::atomic<uint32_t> ref{1};
+    uint32_t len = 0;
+    char data[0];
+};
+
+// 不小于这个长度的value在回复中不拷贝
+const size_t k_zerocopy_min = 512;
+// 每个连接的输出队列中最多引用多少个value
+const size_t k_max_wref = 16;
+
+// 输出队列，有回复排队时才从IO缓冲区池借，全部发完就归还
+// wref[i].val 在逻辑上插在 data[wref[i].off] 之前
+struct WBuf{
+    size_t cap = 0;     // data的容量
+    struct {
+        size_t off;
+        Val *val;
+    } wref[k_max_wref];
+    // io_uring: sendmsg在完成之前要求iovec一直有效
+    struct msghdr msg;
+    struct iovec iov[2 * k_max_wref + 1];
+    uint8_t data[0];
+};
+
+struct ShardReq;
+
+// 连接只在有未处理的输入或者未发送的输出时才持有缓冲区
 struct Conn{
     int fd = -1;
     uint32_t state = 0; // STATE_REQ or STATE_RES
     // for reading
+    // [rbuf_start, rbuf_size) 是还未处理的数据，请求处理完只移动rbuf_start
+    size_t rbuf_start = 0;
     size_t rbuf_size = 0;
-    uint8_t rbuf[4 + k_max_msg];
+    size_t rbuf_cap = 0;
+    uint8_t *rbuf = NULL;
     // for writing
+    // 流水线中的多个回复依次追加到wbuf，一次发出, wbuf_sent按逻辑字节计
     size_t wbuf_size = 0;
     size_t wbuf_sent = 0;
-    uint8_t wbuf[4 + k_max_msg];
+    size_t wval_size = 0;       // 所有wref的value长度之和
+    uint32_t nwref = 0;
+    WBuf *wbuf = NULL;
 
     uint64_t idle_start = 0;
     DList idle_list;
+
+    // io_uring: 收到但rbuf放不下的数据
+    uint8_t *ovf = NULL;
+    size_t ovf_size = 0;
+    size_t ovf_pos = 0;
+    size_t ovf_cap = 0;
+    uint32_t inflight = 0;      // 尚未完成的SQE数量，为0才能释放
+    bool recv_armed = false;
+    bool closing = false;
+
+    // 转发给其他分片还没有取走回复的请求，期间不再解析后面的请求
+    ShardReq *fwd = NULL;
+};
+
+// IO缓冲区池的块大小，默认的out_hwm加上一个回复也放得下
+const size_t k_iobuf_size = 16 * 1024;
+// 池里最多留这么多空闲块，多出来的直接free
+const size_t k_iobuf_pool_max = 1024;
+// Conn按这个数量成批分配
+const size_t k_conn_slab = 64;
+
+// 事件循环后端，启动时选择
+enum{
+    BACKEND_POLL = 0,   // 每轮重建poll数组，O(连接数)
+    BACKEND_EPOLL = 1,  // 边沿触发，只在状态切换时修改interest
+    BACKEND_URING = 2,  // io_uring，每轮只有一次io_uring_enter
 };
 
+// 启动参数，所有线程只读
 static struct
 {
+    int backend = BACKEND_EPOLL;
+    int nthreads = 1;
+    // 待发送的回复达到这个字节数就暂停解析请求
+    size_t out_hwm = 8 * 1024;
+    // 单个请求或回复的最大长度，缓冲区最多扩容到这么大
+    size_t max_msg = 32 << 20;
+    // 每轮事件循环最多花多少微秒推进db的rehash，0表示只由增删查推进
+    uint64_t rehash_us = 1000;
+} g_conf;
+
+struct Shard;
+
+// 投递给一个分片的子命令，执行完再原样投递回发起方的inbox
+struct ShardMsg{
+    ShardMsg *next = NULL;
+    ShardReq *req = NULL;
+    Shard *origin = NULL;
+    bool reply = false;     // 已经执行完，回复在out和ref里
+    std::vector<std::string_view> cmd;
+    std::string out;
+    Val *ref = NULL;
+};
+
+// 转发请求的类型，决定各分片的回复怎么合并
+enum{
+    FWD_ONE = 0,    // 整个命令在另一个分片上执行
+    FWD_KEYS = 1,
+    FWD_STATS = 2,
+    FWD_MULTI = 3,  // mget/mset/mdel按分片拆开
+};
+
+// 转发给其他分片的一个请求，在发起方线程分配、合并回复和回收。
+// 参数拷贝在data里，等待回复期间连接的rbuf照常读写
+struct ShardReq{
+    Conn *conn = NULL;      // 等待期间连接关闭了就是NULL，回复直接丢掉
+    int kind = FWD_ONE;
+    std::string data;
+    std::vector<std::string_view> cmd;
+    std::vector<ShardMsg> msgs;     // 下标是分片号，cmd为空的没有投递
+    std::vector<uint32_t> owner;    // mget: 每个key所在的分片
+    uint32_t waiting = 0;   // 还没有回来的子命令个数
+    // 合并好的回复
+    std::string out;
+    Val *ref = NULL;
+};
+
+// keyspace按key的hash分片，每个事件循环线程独占一个分片，不加锁
+struct Shard{
     HMap db;
+    HStats db_stats;
+    // ZREMRANGEBY*摘下来的子树，在事件循环里分批释放
+    std::vector<AVLNode *> zgarbage;
+    // 其他线程投递过来的命令，以及转发出去的命令的回复，无锁栈(MPSC)
+    std::atomic<ShardMsg *> inbox{NULL};
+    // 线程即将阻塞等待IO，投递方需要通过eventfd唤醒
+    std::atomic<bool> sleeping{false};
+    int wakefd = -1;
+};
+
+static struct
+{
+    Shard *shards = NULL;
+    size_t nshards = 0;
+} g_keyspace;
+
+// 每个事件循环线程各有一份
+static thread_local struct
+{
+    Shard *shard = NULL;    // 本线程拥有的分片
     std::vector<Conn *> fd2conn;
     DList idle_list;
+    int epfd = -1;
+    URing ring;
+    UBufRing bufs;
+    // 解析请求和生成回复用的临时空间，每个请求复用，不再每次分配
+    std::vector<std::string_view> cmd;
+    std::string out;
+    // 空闲的Conn和IO缓冲区，只在本线程内借还，不加锁
+    std::vector<Conn *> free_conns;
+    std::vector<uint8_t *> iobufs;
+    std::vector<ShardReq *> free_reqs;
+    uint64_t rbuf_moved = 0;    // rbuf_make_room一共搬动了多少字节
 } g_data;
 
 
@@ -105,62 +245,295 @@ static void conn_put(std::vector<Conn*> &fd2conn, struct Conn *conn){
 }
 static uint64_t get_monotonic_usec();
 
-static int accept_new_conn(int fd){
-    struct sockaddr_in client_addr = {};
-    socklen_t socklen = sizeof(client_addr);
-    int connfd = accept(fd, (struct sockaddr*)&client_addr, &socklen);
-    if(connfd < 0){
-        msg("accept() error");
-        return -1;  // error
+static uint8_t *buf_realloc(uint8_t *buf, size_t cap){
+    buf = (uint8_t *)realloc(buf, cap);
+    if(!buf){
+        die("realloc()");
+    }
+    return buf;
+}
+
+// 从池里借一块k_iobuf_size大小的缓冲区
+static uint8_t *iobuf_get(){
+    if(g_data.iobufs.empty()){
+        return buf_realloc(NULL, k_iobuf_size);
+    }
+    uint8_t *buf = g_data.iobufs.back();
+    g_data.iobufs.pop_back();
+    return buf;
+}
+
+// 扩容过的缓冲区不放回池里
+static void iobuf_put(uint8_t *buf, size_t size){
+    if(size == k_iobuf_size && g_data.iobufs.size() < k_iobuf_pool_max){
+        g_data.iobufs.push_back(buf);
+    }else{
+        free(buf);
+    }
+}
+
+// 连接频繁建立断开时不走malloc，Conn也不会散落在堆里
+static Conn *conn_alloc(){
+    if(g_data.free_conns.empty()){
+        Conn *slab = (Conn *)malloc(k_conn_slab * sizeof(Conn));
+        if(!slab){
+            return NULL;
+        }
+        for(size_t i = k_conn_slab; i > 0; --i){
+            g_data.free_conns.push_back(&slab[i - 1]);
+        }
     }
+    Conn *conn = g_data.free_conns.back();
+    g_data.free_conns.pop_back();
+    return conn;
+}
+
+static void conn_free(Conn *conn){
+    g_data.free_conns.push_back(conn);
+}
+
+static Conn *conn_new(int connfd){
     // set nonblocking
     fd_set_nb(connfd);
-    struct Conn *conn = (struct Conn*)malloc(sizeof(struct Conn));
+    struct Conn *conn = conn_alloc();
     if(!conn){
         close(connfd);
-        return -1;
+        return NULL;
     }
     conn->fd = connfd;
     conn->state = STATE_REQ;
+    conn->rbuf_start = 0;
     conn->rbuf_size = 0;
+    conn->rbuf_cap = 0;
+    conn->rbuf = NULL;
     conn->wbuf_sent = 0;
     conn->wbuf_size = 0;
+    conn->wbuf = NULL;
+    conn->wval_size = 0;
+    conn->nwref = 0;
+    conn->ovf = NULL;
+    conn->ovf_size = conn->ovf_pos = conn->ovf_cap = 0;
+    conn->inflight = 0;
+    conn->recv_armed = false;
+    conn->closing = false;
+    conn->fwd = NULL;
     conn->idle_start = get_monotonic_usec();
     dlist_insert_before(&g_data.idle_list, &conn->idle_list);
     conn_put(g_data.fd2conn, conn);
+    return conn;
+}
+
+static int accept_new_conn(int fd){
+    struct sockaddr_in client_addr = {};
+    socklen_t socklen = sizeof(client_addr);
+    int connfd = accept(fd, (struct sockaddr*)&client_addr, &socklen);
+    if(connfd < 0){
+        if(errno != EAGAIN){
+            msg("accept() error");
+        }
+        return -1;  // error
+    }
+    Conn *conn = conn_new(connfd);
+    if(!conn){
+        return -1;
+    }
+    if(g_conf.backend == BACKEND_EPOLL){
+        // 新连接处于STATE_REQ
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = connfd;
+        if(epoll_ctl(g_data.epfd, EPOLL_CTL_ADD, connfd, &ev)){
+            die("epoll_ctl()");
+        }
+    }
     return 0;
 }
 static void state_req(struct Conn *conn);
 static void state_res(struct Conn *conn);
-// 处理IO
-static void connection_io(struct Conn *conn){
-    // 可以读取数据了 进行读取操作
+static bool try_one_request(struct Conn *conn);
+// 有IO活动，移到idle list末尾
+static void conn_touch(struct Conn *conn){
     conn->idle_start = get_monotonic_usec();
     dlist_detach(&conn->idle_list);
     dlist_insert_before(&g_data.idle_list, &conn->idle_list);
+}
+// 处理IO
+static void connection_io(struct Conn *conn){
+    // 可以读取数据了 进行读取操作
+    conn_touch(conn);
     if(conn->state == STATE_REQ){
         state_req(conn);
     }else if(conn->state == STATE_RES){
         state_res(conn);
+        // 回复发送完毕后rbuf和socket中可能还有请求，不能等下一次可读事件
+        if(conn->state == STATE_REQ){
+            state_req(conn);
+        }
     }else{
         assert(0);  // not expected
     }
 }
 static bool try_fill_buffer(struct Conn *conn);
 static bool try_flush_buffer(struct Conn *conn);
-static bool try_one_request(struct Conn *conn);
 
+// 输出队列达到高水位，暂停解析请求
+static bool conn_out_full(struct Conn *conn){
+    return conn->wbuf_size >= g_conf.out_hwm || conn->nwref == k_max_wref;
+}
+
+static void val_unref(Val *val);
+
+// 回复全部发送完毕
+static void conn_out_reset(struct Conn *conn){
+    for(uint32_t i = 0; i < conn->nwref; ++i){
+        val_unref(conn->wbuf->wref[i].val);
+    }
+    conn->nwref = 0;
+    conn->wval_size = 0;
+    conn->wbuf_sent = 0;
+    conn->wbuf_size = 0;
+}
+
+// 把还未发送的部分组织成iovec，value直接指向Val::data
+static int conn_out_iov(struct Conn *conn, struct iovec *iov){
+    int n = 0;
+    size_t skip = conn->wbuf_sent;
+    size_t pos = 0;
+    for(uint32_t i = 0; i <= conn->nwref; ++i){
+        size_t end = i < conn->nwref ? conn->wbuf->wref[i].off : conn->wbuf_size;
+        // wbuf[pos, end)
+        size_t len = end - pos;
+        if(skip >= len){
+            skip -= len;
+        }else{
+            iov[n].iov_base = &conn->wbuf->data[pos + skip];
+            iov[n].iov_len = len - skip;
+            n++;
+            skip = 0;
+        }
+        pos = end;
+        if(i == conn->nwref){
+            break;
+        }
+        Val *val = conn->wbuf->wref[i].val;
+        if(skip >= val->len){
+            skip -= val->len;
+        }else{
+            iov[n].iov_base = &val->data[skip];
+            iov[n].iov_len = val->len - skip;
+            n++;
+            skip = 0;
+        }
+    }
+    return n;
+}
+
+// 读到EAGAIN并且回复都发完了，把缓冲区还回池里，扩容过的直接释放
+static void conn_buf_release(struct Conn *conn){
+    if(conn->rbuf && conn->rbuf_start == conn->rbuf_size){
+        iobuf_put(conn->rbuf, conn->rbuf_cap);
+        conn->rbuf = NULL;
+        conn->rbuf_cap = 0;
+        conn->rbuf_start = conn->rbuf_size = 0;
+    }
+    if(conn->wbuf && conn->wbuf_size == 0){
+        iobuf_put((uint8_t *)conn->wbuf, sizeof(WBuf) + conn->wbuf->cap);
+        conn->wbuf = NULL;
+    }
+    if(conn->ovf && conn->ovf_pos == conn->ovf_size){
+        iobuf_put(conn->ovf, conn->ovf_cap);
+        conn->ovf = NULL;
+        conn->ovf_size = conn->ovf_pos = conn->ovf_cap = 0;
+    }
+}
+
+// 连接关闭，不管还有没有数据都归还
+static void conn_buf_drop(struct Conn *conn){
+    conn_out_reset(conn);
+    conn->rbuf_start = conn->rbuf_size;
+    conn->ovf_pos = conn->ovf_size;
+    conn_buf_release(conn);
+}
+
+// 有请求转发给了其他分片还在等回复，已经排队的回复等它到了再一起发
+static bool conn_fwd_waiting(struct Conn *conn){
+    return conn->state == STATE_REQ && conn->fwd && conn->fwd->waiting;
+}
+
+// 解析完本轮能读到的所有请求后再统一发送回复
 static void state_req(struct Conn *conn){
-    while(try_fill_buffer(conn)) {}
+    bool paused = false;
+    do{
+        while(try_one_request(conn)) {}
+        while(conn->state == STATE_REQ && !conn_out_full(conn) && !conn->fwd
+            && try_fill_buffer(conn)) {}
+        if(conn->wbuf_size == 0 || conn_fwd_waiting(conn)){
+            break;
+        }
+        // 因为高水位停下的，发送完之后还要继续读
+        paused = conn_out_full(conn);
+        // 读到EOF也先把已经排队的回复发出去
+        uint32_t state = conn->state;
+        conn->state = STATE_RES;
+        state_res(conn);
+        if(state == STATE_END){
+            conn->state = STATE_END;
+        }
+    }while(paused && conn->state == STATE_REQ);
+    if(conn->state == STATE_REQ){
+        conn_buf_release(conn);
+    }
 }
 static void state_res(struct Conn *conn){
     while(try_flush_buffer(conn)){}
 }
+// read()之前尾部剩余空间小于这个值就把未处理的数据搬回开头，免得read()太碎
+const size_t k_rbuf_low_water = 512;
+
+// 为下一次读取腾出空间，只在当前请求放不下或者尾部空间小于low_water时才memmove。
+// io_uring从内存里拷贝，不怕碎，传0
+// 当前请求比rbuf大时按2倍扩容，超过max_msg的请求会被try_one_request拒绝
+static void rbuf_make_room(struct Conn *conn, size_t low_water){
+    if(!conn->rbuf){
+        conn->rbuf = iobuf_get();
+        conn->rbuf_cap = k_iobuf_size;
+    }
+    size_t unread = conn->rbuf_size - conn->rbuf_start;
+    if(unread == 0){
+        conn->rbuf_start = conn->rbuf_size = 0;
+        return;
+    }
+    // 当前这个请求至少需要的连续空间
+    size_t need = 4;
+    if(unread >= 4){
+        uint32_t len = 0;
+        memcpy(&len, &conn->rbuf[conn->rbuf_start], 4);
+        need += len;
+    }
+    if(need > conn->rbuf_cap && need <= 4 + g_conf.max_msg){
+        size_t cap = conn->rbuf_cap;
+        while(cap < need){
+            cap *= 2;
+        }
+        cap = cap < 4 + g_conf.max_msg ? cap : 4 + g_conf.max_msg;
+        conn->rbuf = buf_realloc(conn->rbuf, cap);
+        conn->rbuf_cap = cap;
+    }
+    size_t tail = conn->rbuf_cap - conn->rbuf_size;
+    if(tail < low_water || conn->rbuf_start + need > conn->rbuf_cap){
+        memmove(conn->rbuf, &conn->rbuf[conn->rbuf_start], unread);
+        g_data.rbuf_moved += unread;
+        conn->rbuf_start = 0;
+        conn->rbuf_size = unread;
+    }
+}
+
 static bool try_fill_buffer(struct Conn *conn){
-    assert(conn->rbuf_size < sizeof(conn->rbuf));
+    rbuf_make_room(conn, k_rbuf_low_water);
+    assert(conn->rbuf_size < conn->rbuf_cap);
     ssize_t rv = 0;
     do{
-        size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;
+        size_t cap = conn->rbuf_cap - conn->rbuf_size;
         rv = read(conn->fd, &(conn->rbuf[conn->rbuf_size]), cap);
     } while(rv < 0 && errno == EINTR);
     if(rv < 0 && errno == EAGAIN){
@@ -175,7 +548,7 @@ static bool try_fill_buffer(struct Conn *conn){
         // 这个判断有点意思 当conn->rbuf_size > 0时结合后面try_one_request函数理解
         // conn->rbuf_size > 0表示读取数据不完整还应该进行读取，但是 rv == 0 表示读到了EOF，这就有问题了！！
         // 发生了未知EOF
-        if(conn->rbuf_size > 0){
+        if(conn->rbuf_size > conn->rbuf_start){
             msg("unexpected EOF");
         }else{
             msg("EOF");
@@ -184,7 +557,7 @@ static bool try_fill_buffer(struct Conn *conn){
         return false;
     }
     conn->rbuf_size += (size_t) rv;
-    assert(conn->rbuf_size <= sizeof(conn->rbuf));
+    assert(conn->rbuf_size <= conn->rbuf_cap);
     // Try to process requests one by one.
     // Why is there a loop? Please read the explanation of "pipelining".
     while (try_one_request(conn)) {}
@@ -193,9 +566,10 @@ static bool try_fill_buffer(struct Conn *conn){
 
 static bool try_flush_buffer(struct Conn *conn){
     ssize_t rv = 0;
+    struct iovec iov[2 * k_max_wref + 1];
+    int iovcnt = conn_out_iov(conn, iov);
     do {
-        size_t remain = conn->wbuf_size - conn->wbuf_sent;
-        rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain);
+        rv = writev(conn->fd, iov, iovcnt);
     } while (rv < 0 && errno == EINTR);
     if (rv < 0 && errno == EAGAIN) {
         // got EAGAIN, stop.
@@ -207,12 +581,11 @@ static bool try_flush_buffer(struct Conn *conn){
         return false;
     }
     conn->wbuf_sent += (size_t)rv;
-    assert(conn->wbuf_sent <= conn->wbuf_size);
-    if (conn->wbuf_sent == conn->wbuf_size) {
+    assert(conn->wbuf_sent <= conn->wbuf_size + conn->wval_size);
+    if (conn->wbuf_sent == conn->wbuf_size + conn->wval_size) {
         // response was fully sent, change state back
         conn->state = STATE_REQ;
-        conn->wbuf_sent = 0;
-        conn->wbuf_size = 0;
+        conn_out_reset(conn);
         return false;
     }
     // still got some data in wbuf, could try to write again
@@ -221,10 +594,12 @@ static bool try_flush_buffer(struct Conn *conn){
 
 
 
-static int32_t parse_req(const uint8_t* req, uint32_t reqlen, std::vector<std::string> &cmd);
+static int32_t parse_req(
+    const uint8_t* req, uint32_t reqlen, std::vector<std::string_view> &cmd);
 
-static bool cmd_is(const std::string &word, const char *cmd) {
-    return 0 == strcasecmp(word.c_str(), cmd);
+static bool cmd_is(std::string_view word, const char *cmd) {
+    return word.size() == strlen(cmd)
+        && 0 == strncasecmp(word.data(), cmd, word.size());
 }
 
 enum{
@@ -233,34 +608,155 @@ enum{
     RES_NX = 2, // 不存在
 };
 
+// 参数不是以'\0'结尾的，先拷贝到栈上
+static bool str2dbl(std::string_view s, double &out) {
+    char tmp[64];
+    std::string big;
+    char *buf = tmp;
+    if (s.size() >= sizeof(tmp)) {
+        big.assign(s);  // 很少见，比如一长串0
+        buf = &big[0];
+    } else {
+        memcpy(buf, s.data(), s.size());
+        buf[s.size()] = '\0';
+    }
+    char *endp = NULL;
+    out = strtod(buf, &endp);
+    return endp == buf + s.size() && !isnan(out);
+}
+
+static bool str2int(std::string_view s, int64_t &out) {
+    char buf[32];
+    if (s.size() >= sizeof(buf)) {
+        return false;   // 超出int64的范围
+    }
+    memcpy(buf, s.data(), s.size());
+    buf[s.size()] = '\0';
+    char *endp = NULL;
+    out = strtoll(buf, &endp, 10);
+    return endp == buf + s.size();
+}
+
+// 只接受GET能原样还原的写法，没有前导0、'+'和空格，也不能溢出
+static bool str2int_exact(std::string_view s, int64_t &out) {
+    char buf[32];
+    return s.size() <= 20 && str2int(s, out)
+        && (size_t)snprintf(buf, sizeof(buf), "%lld", (long long)out) == s.size()
+        && 0 == memcmp(buf, s.data(), s.size());
+}
+
 enum{
     T_STR = 0,
     T_ZSET = 1,
 };
 
+// T_STR的value编码
+enum{
+    ENC_INT = 0,    // value是整数，存在ival里
+    ENC_EMB = 1,    // 短value紧跟在key后面，和Entry是同一次分配
+    ENC_VAL = 2,    // 长value单独分配，GET时零拷贝引用
+};
+
+// key总是内联在Entry的分配里，小value也一样
 struct Entry{
     struct HNode node;
-    std::string key;
-    std::string val;
-    uint32_t type = 0;
-    ZSet *zset = NULL;
+    uint32_t klen;
+    uint8_t type;
+    uint8_t enc;
+    union{
+        int64_t ival;   // ENC_INT
+        uint32_t vlen;  // ENC_EMB, value在key[klen]
+        Val *val;       // ENC_VAL
+        ZSet *zset;     // T_ZSET
+    };
+    char key[0];
 };
 
-// cmp function
-static bool entry_eq(HNode *lhs, HNode *rhs) {
-    struct Entry *le = container_of(lhs, struct Entry, node);
-    struct Entry *re = container_of(rhs, struct Entry, node);
-    return lhs->hcode == rhs->hcode && le->key == re->key;
+static Val *val_new(std::string_view s){
+    Val *val = (Val *)malloc(sizeof(Val) + s.size());
+    assert(val);
+    val->ref.store(1, std::memory_order_relaxed);
+    val->len = (uint32_t)s.size();
+    memcpy(val->data, s.data(), s.size());
+    return val;
+}
+
+// 其他线程可能还持有引用，计数必须是原子的
+static Val *val_ref(Val *val){
+    val->ref.fetch_add(1, std::memory_order_relaxed);
+    return val;
+}
+
+static void val_unref(Val *val){
+    if(val && val->ref.fetch_sub(1, std::memory_order_acq_rel) == 1){
+        free(val);
+    }
+}
+
+// vsize是内联value的空间
+static Entry *entry_new(std::string_view key, uint64_t hcode, size_t vsize){
+    Entry *ent = (Entry *)malloc(sizeof(Entry) + key.size() + vsize);
+    assert(ent);
+    ent->node.next = NULL;
+    ent->node.hcode = hcode;
+    ent->klen = (uint32_t)key.size();
+    ent->type = T_STR;
+    ent->enc = ENC_INT;
+    ent->ival = 0;
+    memcpy(ent->key, key.data(), key.size());
+    return ent;
+}
+
+static std::string_view entry_key(Entry *ent){
+    return std::string_view(ent->key, ent->klen);
+}
+
+// 整数以外的value，比回复零拷贝的门槛短就内联
+static uint8_t str_enc(std::string_view val, int64_t &ival){
+    if(str2int_exact(val, ival)){
+        return ENC_INT;
+    }
+    return val.size() < k_zerocopy_min ? ENC_EMB : ENC_VAL;
+}
+
+// ENC_EMB时调用方要保证分配的空间放得下
+static void entry_set_str(Entry *ent, std::string_view val, uint8_t enc, int64_t ival){
+    ent->type = T_STR;
+    ent->enc = enc;
+    if(enc == ENC_INT){
+        ent->ival = ival;
+    }else if(enc == ENC_EMB){
+        ent->vlen = (uint32_t)val.size();
+        memcpy(ent->key + ent->klen, val.data(), val.size());
+    }else{
+        ent->val = val_new(val);
+    }
 }
-// hash function
-static uint64_t str_hash(const uint8_t *data, size_t len) {
-    uint32_t h = 0x811C9DC5;
-    for (size_t i = 0; i < len; i++) {
-        h = (h + data[i]) * 0x01000193;
+
+static void entry_del(Entry *ent){
+    if(ent->type == T_ZSET){
+        zset_dispose(ent->zset);
+        delete ent->zset;
+    }else if(ent->enc == ENC_VAL){
+        // 旧value可能还在某个连接的输出队列里，只释放引用
+        val_unref(ent->val);
     }
-    return h;
+    free(ent);
 }
 
+// 主键空间的hashtable，查找用的key直接指向请求参数，不拷贝
+struct EntryTr{
+    typedef Entry T;
+    typedef std::string_view Key;
+    static const size_t offset = offsetof(Entry, node);
+    static uint64_t hash(std::string_view key){
+        return str_hash((uint8_t *)key.data(), key.size());
+    }
+    static bool eq(Entry *ent, std::string_view key){
+        return entry_key(ent) == key;
+    }
+};
+
 
 static void out_nil(std::string &out){
     out.push_back(SER_NIL);
@@ -273,12 +769,6 @@ static void out_str(std::string &out, const char *s, size_t size) {
     out.append(s, len);
 }
 
-static void out_str(std::string &out, const std::string &val){
-    out.push_back(SER_STR);
-    uint32_t len = val.size();
-    out.append((char *)&len, 4);
-    out.append(val);
-}
 static void out_int(std::string &out, int64_t val){
     out.push_back(SER_INT);
     out.append((char *)&val, 8);
@@ -307,50 +797,157 @@ static void out_update_arr(std::string &out, uint32_t n) {
 
 
 // key -> val
-static void do_get( std::vector<std::string> &cmd, std::string &out){
-    // get key
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+// ref不为空时，较大的value不写进out，而是返回一份引用由调用方直接发送
+static void out_entry_str(std::string &out, Entry *ent, Val **ref){
+    if(ent->enc == ENC_INT){
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "%lld", (long long)ent->ival);
+        return out_str(out, buf, len);
+    }
+    if(ent->enc == ENC_EMB){
+        return out_str(out, ent->key + ent->klen, ent->vlen);
+    }
+    Val *val = ent->val;
+    if(ref && val->len >= k_zerocopy_min){
+        out.push_back(SER_STR);
+        out.append((char *)&val->len, 4);
+        *ref = val_ref(val);
+        return;
+    }
+    return out_str(out, val->data, val->len);
+}
 
-    if(!node){
+static void do_get( std::vector<std::string_view> &cmd, std::string &out, Val **ref){
+    // get key
+    Entry *ent = hm_lookup<EntryTr>(&g_data.shard->db, cmd[1]);
+    if(!ent){
         return out_nil(out);
     }
-    std::string &val = container_of(node, Entry, node)->val;
-    return out_str(out, val);
+    if(ent->type != T_STR){
+        return out_err(out, ERR_TYPE, "expect string");
+    }
+    return out_entry_str(out, ent, ref);
 }
 
-static void do_set(std::vector<std::string> &cmd, std::string &out){
-    assert(cmd[2].size() <= k_max_msg); // 虽然冗余 但是或许还是有用的
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if(node){
-        container_of(node, Entry, node)->val.swap(cmd[2]);
-    }else{
-        Entry *ent = new Entry();
-        ent->key.swap(key.key);
-        ent->val.swap(cmd[2]);
-        ent->node.hcode = key.node.hcode;
-        hm_insert(&g_data.db, &ent->node);
+// ent是key当前的查找结果
+static void db_set(std::string_view key, uint64_t hcode, Entry *ent, std::string_view val){
+    assert(val.size() <= g_conf.max_msg); // 虽然冗余 但是或许还是有用的
+    int64_t ival = 0;
+    uint8_t enc = str_enc(val, ival);
+    size_t vsize = enc == ENC_EMB ? val.size() : 0;
+    if(ent){
+        // 原来的分配放得下就原地覆盖，否则换一个Entry
+        size_t need = sizeof(Entry) + ent->klen + vsize;
+        if(ent->type == T_STR && malloc_usable_size(ent) >= need){
+            if(ent->enc == ENC_VAL){
+                val_unref(ent->val);
+            }
+            entry_set_str(ent, val, enc, ival);
+            return;
+        }
+        hm_pop<EntryTr>(&g_data.shard->db, key, hcode);
+        entry_del(ent);
     }
+    ent = entry_new(key, hcode, vsize);
+    entry_set_str(ent, val, enc, ival);
+    hm_insert(&g_data.shard->db, &ent->node);
+}
+
+static void do_set(std::vector<std::string_view> &cmd, std::string &out){
+    std::string_view key = cmd[1];
+    uint64_t hcode = EntryTr::hash(key);
+    db_set(key, hcode, hm_lookup<EntryTr>(&g_data.shard->db, key, hcode), cmd[2]);
     return out_nil(out);
 }
 
-static void do_del( std::vector<std::string> &cmd, std::string &out){
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *node = hm_pop(&g_data.db, &key.node, &entry_eq);
-    out_int(out, node ? 1 : 0);
-    if(node){
-        delete container_of(node, Entry, node);
+static void do_del( std::vector<std::string_view> &cmd, std::string &out){
+    Entry *ent = hm_pop<EntryTr>(&g_data.shard->db, cmd[1]);
+    out_int(out, ent ? 1 : 0);
+    if(ent){
+        entry_del(ent);
     }
     return;
 }
 
+// 多key命令每次批量查找这么多个key
+const size_t k_batch = 16;
+
+// mget key...
+// 不是字符串的key返回nil，回复里的value都是拷贝
+static void do_mget(std::vector<std::string_view> &cmd, std::string &out){
+    std::string_view *keys = &cmd[1];
+    size_t nkeys = cmd.size() - 1;
+    uint64_t hcodes[k_batch];
+    Entry *ents[k_batch];
+    out_arr(out, (uint32_t)nkeys);
+    for(size_t i = 0; i < nkeys; i += k_batch){
+        size_t n = nkeys - i < k_batch ? nkeys - i : k_batch;
+        hm_lookup_many<EntryTr>(&g_data.shard->db, n, &keys[i], hcodes, ents);
+        for(size_t j = 0; j < n; ++j){
+            if(ents[j] && ents[j]->type == T_STR){
+                out_entry_str(out, ents[j], NULL);
+            }else{
+                out_nil(out);
+            }
+        }
+    }
+}
+
+// 同一批里前面出现过同一个key时，查找结果可能已经过时
+static bool batch_dup(std::string_view *keys, uint64_t *hcodes, size_t j){
+    for(size_t i = 0; i < j; ++i){
+        if(hcodes[i] == hcodes[j] && keys[i] == keys[j]){
+            return true;
+        }
+    }
+    return false;
+}
+
+// mset key value [key value]...
+static void do_mset(std::vector<std::string_view> &cmd, std::string &out){
+    size_t npairs = (cmd.size() - 1) / 2;
+    std::string_view keys[k_batch];
+    uint64_t hcodes[k_batch];
+    Entry *ents[k_batch];
+    for(size_t i = 0; i < npairs; i += k_batch){
+        size_t n = npairs - i < k_batch ? npairs - i : k_batch;
+        for(size_t j = 0; j < n; ++j){
+            keys[j] = cmd[1 + 2 * (i + j)];
+        }
+        hm_lookup_many<EntryTr>(&g_data.shard->db, n, keys, hcodes, ents);
+        for(size_t j = 0; j < n; ++j){
+            Entry *ent = ents[j];
+            if(batch_dup(keys, hcodes, j)){
+                ent = hm_lookup<EntryTr>(&g_data.shard->db, keys[j], hcodes[j]);
+            }
+            db_set(keys[j], hcodes[j], ent, cmd[2 + 2 * (i + j)]);
+        }
+    }
+    return out_nil(out);
+}
+
+// mdel key...
+// 批量查找只用来预取，删除时再按key取出，重复的key自然只删一次
+static void do_mdel(std::vector<std::string_view> &cmd, std::string &out){
+    std::string_view *keys = &cmd[1];
+    size_t nkeys = cmd.size() - 1;
+    uint64_t hcodes[k_batch];
+    Entry *ents[k_batch];
+    int64_t deleted = 0;
+    for(size_t i = 0; i < nkeys; i += k_batch){
+        size_t n = nkeys - i < k_batch ? nkeys - i : k_batch;
+        hm_lookup_many<EntryTr>(&g_data.shard->db, n, &keys[i], hcodes, ents);
+        for(size_t j = 0; j < n; ++j){
+            Entry *ent = ents[j] ? hm_pop<EntryTr>(&g_data.shard->db, keys[i + j], hcodes[j]) : NULL;
+            if(ent){
+                entry_del(ent);
+                deleted++;
+            }
+        }
+    }
+    return out_int(out, deleted);
+}
+
 static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
     if (tab->size == 0) {
         return;
@@ -366,74 +963,222 @@ static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
 
 static void cb_scan(HNode *node, void *arg) {
     std::string &out = *(std::string *)arg;
-    out_str(out, container_of(node, Entry, node)->key);
+    Entry *ent = container_of(node, Entry, node);
+    out_str(out, ent->key, ent->klen);
 }
 
-static void do_keys(std::vector<std::string> &cmd, std::string &out) {
+static void do_keys(std::vector<std::string_view> &cmd, std::string &out) {
     (void)cmd;
-    out_arr(out, (uint32_t)hm_size(&g_data.db));
-    h_scan(&g_data.db.ht1, &cb_scan, &out);
-    h_scan(&g_data.db.ht2, &cb_scan, &out);
+    out_arr(out, (uint32_t)hm_size(&g_data.shard->db));
+    h_scan(&g_data.shard->db.ht1, &cb_scan, &out);
+    h_scan(&g_data.shard->db.ht2, &cb_scan, &out);
 }
 
+static void out_stat(std::string &out, const char *name, int64_t val) {
+    out_str(out, name, strlen(name));
+    out_int(out, val);
+}
 
-static bool str2dbl(const std::string &s, double &out) {
-    char *endp = NULL;
-    out = strtod(s.c_str(), &endp);
-    return endp == s.c_str() + s.size() && !isnan(out);
+// stats: 名字和数值交替的数组，多个分片的数值按位置合并
+// probes/lookups是平均每次查找比较的节点数，probe_hist_N是比较了不超过N个
+// (和上一档之间)节点的查找次数，rehash_pos/rehash_buckets是rehash的进度，
+// rbuf_moved是这个线程压缩连接输入缓冲区搬动的字节数
+static void do_stats(std::vector<std::string_view> &cmd, std::string &out) {
+    (void)cmd;
+    static const char *const hist_names[k_probe_hist] = {
+        "probe_hist_0", "probe_hist_1", "probe_hist_2", "probe_hist_4",
+        "probe_hist_8", "probe_hist_16", "probe_hist_inf",
+    };
+    HMap *db = &g_data.shard->db;
+    HStats *st = db->stats;
+    size_t buckets = 0;
+    buckets += db->ht1.tab ? db->ht1.mask + 1 : 0;
+    buckets += db->ht2.tab ? db->ht2.mask + 1 : 0;
+    out_arr(out, 2 * (13 + k_probe_hist));
+    out_stat(out, "keys", (int64_t)hm_size(db));
+    out_stat(out, "buckets", (int64_t)buckets);
+    out_stat(out, "rehash_left", (int64_t)hm_rehash_left(db));
+    out_stat(out, "rehash_pos", db->ht2.tab ? (int64_t)db->resizing_pos : 0);
+    out_stat(out, "rehash_buckets", db->ht2.tab ? (int64_t)db->ht2.mask + 1 : 0);
+    out_stat(out, "lookups", (int64_t)st->lookups);
+    out_stat(out, "probes", (int64_t)st->probes);
+    out_stat(out, "max_probes", (int64_t)st->max_probes);
+    for (size_t i = 0; i < k_probe_hist; ++i) {
+        out_stat(out, hist_names[i], (int64_t)st->probe_hist[i]);
+    }
+    out_stat(out, "resizes", (int64_t)st->resizes);
+    out_stat(out, "resize_us", (int64_t)(st->resize_ns / 1000));
+    out_stat(out, "max_resize_step_us", (int64_t)(st->max_resize_step_ns / 1000));
+    out_stat(out, "last_resize_us", (int64_t)(st->last_resize_ns / 1000));
+    out_stat(out, "rbuf_moved", (int64_t)g_data.rbuf_moved);
 }
 
-static bool str2int(const std::string &s, int64_t &out) {
-    char *endp = NULL;
-    out = strtoll(s.c_str(), &endp, 10);
-    return endp == s.c_str() + s.size();
+
+// 通配符匹配pat[p]开始的一个元素，匹配c时返回元素的长度，否则返回0
+// 支持 ? [abc] [a-z] [^abc] 和 \ 转义
+static size_t glob_one(std::string_view pat, size_t p, char c) {
+    if (pat[p] == '?') {
+        return 1;
+    }
+    if (pat[p] == '\\' && p + 1 < pat.size()) {
+        return pat[p + 1] == c ? 2 : 0;
+    }
+    if (pat[p] != '[') {
+        return pat[p] == c ? 1 : 0;
+    }
+    size_t q = p + 1;
+    bool neg = q < pat.size() && pat[q] == '^';
+    q += neg;
+    bool hit = false;
+    size_t first = q;
+    while (q < pat.size() && (pat[q] != ']' || q == first)) {
+        char lo = pat[q];
+        if (lo == '\\' && q + 1 < pat.size()) {
+            lo = pat[++q];
+        }
+        char hi = lo;
+        if (q + 2 < pat.size() && pat[q + 1] == '-' && pat[q + 2] != ']') {
+            hi = pat[q + 2];
+            q += 2;
+        }
+        hit = hit || (lo <= c && c <= hi);
+        q++;
+    }
+    if (q == pat.size()) {
+        return pat[p] == c ? 1 : 0;     // 没有']'，当作普通字符
+    }
+    return hit != neg ? q + 1 - p : 0;
+}
+
+static bool glob_match(std::string_view pat, std::string_view s) {
+    size_t p = 0, i = 0;
+    size_t star = std::string_view::npos, mark = 0;
+    while (i < s.size()) {
+        if (p < pat.size() && pat[p] == '*') {
+            star = ++p;
+            mark = i;
+            continue;
+        }
+        size_t len = p < pat.size() ? glob_one(pat, p, s[i]) : 0;
+        if (len) {
+            p += len;
+            i++;
+        } else if (star != std::string_view::npos) {
+            // 让上一个*多吃掉一个字符
+            p = star;
+            i = ++mark;
+        } else {
+            return false;
+        }
+    }
+    while (p < pat.size() && pat[p] == '*') {
+        p++;
+    }
+    return p == pat.size();
+}
+
+struct ScanArg {
+    std::string *out = NULL;
+    std::string_view pat;
+    bool match = false;
+    uint32_t n = 0;
+};
+
+static void cb_scan_match(HNode *node, void *arg) {
+    ScanArg *sa = (ScanArg *)arg;
+    std::string_view key = entry_key(container_of(node, Entry, node));
+    if (!sa->match || glob_match(sa->pat, key)) {
+        out_str(*sa->out, key.data(), key.size());
+        sa->n++;
+    }
+}
+
+// COUNT的上限，count * 10不会溢出，一次调用的工作量也有个头
+const int64_t k_scan_max_count = 1 << 20;
+
+// scan cursor [match pattern] [count n]
+// 回复 [下一个游标, [key...]]，游标为0表示遍历结束
+// 游标 = 桶游标 * 分片数 + 分片号，一个分片遍历完再换下一个分片
+static void do_scan(std::vector<std::string_view> &cmd, std::string &out) {
+    int64_t cursor = 0;
+    if (!str2int(cmd[1], cursor) || cursor < 0) {
+        return out_err(out, ERR_ARG, "invalid cursor");
+    }
+    ScanArg sa;
+    int64_t count = 10;
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        if (i + 1 < cmd.size() && cmd_is(cmd[i], "match")) {
+            sa.pat = cmd[i + 1];
+            sa.match = true;
+        } else if (i + 1 < cmd.size() && cmd_is(cmd[i], "count")) {
+            if (!str2int(cmd[i + 1], count) || count <= 0) {
+                return out_err(out, ERR_ARG, "expect positive int");
+            }
+            count = count < k_scan_max_count ? count : k_scan_max_count;
+        } else {
+            return out_err(out, ERR_ARG, "syntax error");
+        }
+    }
+
+    size_t nshards = g_keyspace.nshards;
+    size_t self = g_data.shard - g_keyspace.shards;
+    assert((uint64_t)cursor % nshards == self);
+    uint64_t v = (uint64_t)cursor / nshards;
+
+    out_arr(out, 2);
+    size_t pos = out.size();
+    out_int(out, 0);            // 下一个游标，最后再填
+    size_t arr = out.size();
+    out_arr(out, 0);
+    sa.out = &out;
+    // COUNT只是提示: 按桶遍历，空桶多的时候也限制一下工作量
+    uint64_t steps = 0;
+    do {
+        v = hm_scan(&g_data.shard->db, v, &cb_scan_match, &sa);
+    } while (v && sa.n < (uint64_t)count && ++steps < (uint64_t)count * 10);
+
+    uint64_t next = 0;
+    if (v) {
+        next = v * nshards + self;
+    } else if (self + 1 < nshards) {
+        next = self + 1;
+    }
+    memcpy(&out[pos + 1], &next, 8);
+    memcpy(&out[arr + 1], &sa.n, 4);
 }
 
 // zadd zset score name
-static void do_zadd(std::vector<std::string> &cmd, std::string &out) {
+static void do_zadd(std::vector<std::string_view> &cmd, std::string &out) {
     double score = 0;
     if (!str2dbl(cmd[2], score)) {
         return out_err(out, ERR_ARG, "expect fp number");
     }
 
     // look up or create the zset
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-
-    Entry *ent = NULL;
-    if (!hnode) {
-        ent = new Entry();
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
+    std::string_view key = cmd[1];
+    uint64_t hcode = EntryTr::hash(key);
+    Entry *ent = hm_lookup<EntryTr>(&g_data.shard->db, key, hcode);
+    if (!ent) {
+        ent = entry_new(key, hcode, 0);
         ent->type = T_ZSET;
         ent->zset = new ZSet();
-        hm_insert(&g_data.db, &ent->node);
-    } else {
-        ent = container_of(hnode, Entry, node);
-        if (ent->type != T_ZSET) {
-            return out_err(out, ERR_TYPE, "expect zset");
-        }
+        hm_insert(&g_data.shard->db, &ent->node);
+    } else if (ent->type != T_ZSET) {
+        return out_err(out, ERR_TYPE, "expect zset");
     }
 
     // add or update the tuple
-    const std::string &name = cmd[3];
+    std::string_view name = cmd[3];
     bool added = zset_add(ent->zset, name.data(), name.size(), score);
     return out_int(out, (int64_t)added);
 }
 
-static bool expect_zset(std::string &out, std::string &s, Entry **ent) {
-    Entry key;
-    key.key.swap(s);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!hnode) {
+static bool expect_zset(std::string &out, std::string_view s, Entry **ent) {
+    *ent = hm_lookup<EntryTr>(&g_data.shard->db, s);
+    if (!*ent) {
         out_nil(out);
         return false;
     }
-
-    *ent = container_of(hnode, Entry, node);
     if ((*ent)->type != T_ZSET) {
         out_err(out, ERR_TYPE, "expect zset");
         return false;
@@ -442,40 +1187,77 @@ static bool expect_zset(std::string &out, std::string &s, Entry **ent) {
 }
 
 // zrem zset name
-static void do_zrem(std::vector<std::string> &cmd, std::string &out) {
+static void do_zrem(std::vector<std::string_view> &cmd, std::string &out) {
     Entry *ent = NULL;
     if (!expect_zset(out, cmd[1], &ent)) {
         return;
     }
 
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_pop(ent->zset, name.data(), name.size());
-    if (znode) {
-        znode_del(znode);
-    }
-    return out_int(out, znode ? 1 : 0);
+    std::string_view name = cmd[2];
+    bool removed = zset_rem(ent->zset, name.data(), name.size());
+    return out_int(out, removed ? 1 : 0);
 }
 
 // zscore zset name
-static void do_zscore(std::vector<std::string> &cmd, std::string &out) {
+static void do_zscore(std::vector<std::string_view> &cmd, std::string &out) {
     Entry *ent = NULL;
     if (!expect_zset(out, cmd[1], &ent)) {
         return;
     }
 
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_lookup(ent->zset, name.data(), name.size());
-    return znode ? out_dbl(out, znode->score) : out_nil(out);
+    std::string_view name = cmd[2];
+    double score = 0;
+    bool found = zset_score(ent->zset, name.data(), name.size(), &score);
+    return found ? out_dbl(out, score) : out_nil(out);
+}
+
+// 范围查询在键不存在时回复空数组
+static bool expect_zset_arr(std::string &out, std::string_view s, Entry **ent) {
+    if (expect_zset(out, s, ent)) {
+        return true;
+    }
+    if (out[0] == SER_NIL) {
+        out.clear();
+        out_arr(out, 0);
+    }
+    return false;
+}
+
+// 计数类的命令在键不存在时回复0
+static bool expect_zset_int(std::string &out, std::string_view s, Entry **ent) {
+    if (expect_zset(out, s, ent)) {
+        return true;
+    }
+    if (out[0] == SER_NIL) {
+        out.clear();
+        out_int(out, 0);
+    }
+    return false;
+}
+
+// 把可以为负的闭区间[start, stop]换算成实际的排名，区间为空时返回false
+static bool zrank_clamp(int64_t size, int64_t &start, int64_t &stop) {
+    start = start < 0 ? start + size : start;
+    stop = stop < 0 ? stop + size : stop;
+    start = start < 0 ? 0 : start;
+    stop = stop >= size ? size - 1 : stop;
+    return start <= stop;
+}
+
+// 分数区间的端点，"("开头表示不含端点，可以是inf/-inf
+static bool str2bound(std::string_view s, double &out, bool &ex) {
+    ex = !s.empty() && s[0] == '(';
+    return str2dbl(ex ? s.substr(1) : s, out);
 }
 
 // zquery zset score name offset limit
-static void do_zquery(std::vector<std::string> &cmd, std::string &out) {
+static void do_zquery(std::vector<std::string_view> &cmd, std::string &out) {
     // parse args
     double score = 0;
     if (!str2dbl(cmd[2], score)) {
         return out_err(out, ERR_ARG, "expect fp number");
     }
-    const std::string &name = cmd[3];
+    std::string_view name = cmd[3];
     int64_t offset = 0;
     int64_t limit = 0;
     if (!str2int(cmd[4], offset)) {
@@ -487,11 +1269,7 @@ static void do_zquery(std::vector<std::string> &cmd, std::string &out) {
 
     // get the zset
     Entry *ent = NULL;
-    if (!expect_zset(out, cmd[1], &ent)) {
-        if (out[0] == SER_NIL) {
-            out.clear();
-            out_arr(out, 0);
-        }
+    if (!expect_zset_arr(out, cmd[1], &ent)) {
         return;
     }
 
@@ -499,32 +1277,194 @@ static void do_zquery(std::vector<std::string> &cmd, std::string &out) {
     if (limit <= 0) {
         return out_arr(out, 0);
     }
-    ZNode *znode = zset_query(
+    ZIter it = zset_query(
         ent->zset, score, name.data(), name.size(), offset
     );
 
     // output
     out_arr(out, 0);    // the array length will be updated later
     uint32_t n = 0;
-    while (znode && (int64_t)n < limit) {
-        out_str(out, znode->name, znode->len);
-        out_dbl(out, znode->score);
-        znode = container_of(avl_offset(&znode->tree, +1), ZNode, tree);
+    while (it.ok && (int64_t)n < limit) {
+        size_t len = 0;
+        const char *s = zit_name(it, &len);
+        out_str(out, s, len);
+        out_dbl(out, zit_score(it));
+        it = zit_offset(it, +1);
         n += 2;
     }
     return out_update_arr(out, n);
 }
 
+// 从it开始沿dir方向输出count个(name, score)
+static void out_zrange(std::string &out, ZIter it, uint64_t count, int64_t dir) {
+    out_arr(out, 0);
+    uint32_t n = 0;
+    for (uint64_t i = 0; it.ok && i < count; ++i) {
+        size_t len = 0;
+        const char *name = zit_name(it, &len);
+        out_str(out, name, len);
+        out_dbl(out, zit_score(it));
+        it = zit_offset(it, dir);
+        n += 2;
+    }
+    return out_update_arr(out, n);
+}
 
-static void do_request(std::vector<std::string> &cmd, std::string &out){
-    if(cmd.size() == 1 && cmd_is(cmd[0], "keys")){
+// zrange zset start stop, zrevrange zset start stop
+// 按排名取，stop也包含在内，负数从末尾算起
+static void do_zrange(std::vector<std::string_view> &cmd, std::string &out, bool rev) {
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    Entry *ent = NULL;
+    if (!expect_zset_arr(out, cmd[1], &ent)) {
+        return;
+    }
+
+    int64_t size = (int64_t)zset_size(ent->zset);
+    if (!zrank_clamp(size, start, stop)) {
+        return out_arr(out, 0);
+    }
+    // 反向时排名从最大的一端数
+    uint64_t first = rev ? size - 1 - start : start;
+    ZIter it = zset_at(ent->zset, first);
+    return out_zrange(out, it, stop - start + 1, rev ? -1 : +1);
+}
+
+// zrevrangebyscore zset max min [limit offset count]
+// 把分数区间换成排名区间[lo, hi)，从hi-1往回走
+static void do_zrevrangebyscore(std::vector<std::string_view> &cmd, std::string &out) {
+    double max = 0, min = 0;
+    bool maxex = false, minex = false;
+    if (!str2bound(cmd[2], max, maxex) || !str2bound(cmd[3], min, minex)) {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+    int64_t offset = 0, count = -1;
+    if (cmd.size() == 7) {
+        if (!cmd_is(cmd[4], "limit")) {
+            return out_err(out, ERR_ARG, "syntax error");
+        }
+        if (!str2int(cmd[5], offset) || !str2int(cmd[6], count)) {
+            return out_err(out, ERR_ARG, "expect int");
+        }
+    }
+    Entry *ent = NULL;
+    if (!expect_zset_arr(out, cmd[1], &ent)) {
+        return;
+    }
+
+    uint64_t hi = zset_count_below(ent->zset, max, !maxex);
+    uint64_t lo = zset_count_below(ent->zset, min, minex);
+    uint64_t total = hi > lo ? hi - lo : 0;
+    if (offset < 0 || (uint64_t)offset >= total || count == 0) {
+        return out_arr(out, 0);
+    }
+    uint64_t left = total - offset;
+    uint64_t n = count < 0 || (uint64_t)count > left ? left : (uint64_t)count;
+    ZIter it = zset_at(ent->zset, hi - 1 - offset);
+    return out_zrange(out, it, n, -1);
+}
+
+// zrank zset name, zrevrank zset name
+static void do_zrank(std::vector<std::string_view> &cmd, std::string &out, bool rev) {
+    Entry *ent = NULL;
+    if (!expect_zset(out, cmd[1], &ent)) {
+        return;
+    }
+
+    std::string_view name = cmd[2];
+    uint64_t rank = 0;
+    if (!zset_rank(ent->zset, name.data(), name.size(), &rank)) {
+        return out_nil(out);
+    }
+    if (rev) {
+        rank = zset_size(ent->zset) - 1 - rank;
+    }
+    return out_int(out, (int64_t)rank);
+}
+
+// 摘下来的元素不在这里释放，交给事件循环
+static void zrem_range(std::string &out, Entry *ent, uint64_t start, uint64_t stop) {
+    AVLNode *garbage = zset_rem_range(ent->zset, start, stop);
+    if (garbage) {
+        g_data.shard->zgarbage.push_back(garbage);
+    }
+    return out_int(out, (int64_t)(stop - start));
+}
+
+// zremrangebyrank zset start stop
+static void do_zremrangebyrank(std::vector<std::string_view> &cmd, std::string &out) {
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    Entry *ent = NULL;
+    if (!expect_zset_int(out, cmd[1], &ent)) {
+        return;
+    }
+
+    if (!zrank_clamp((int64_t)zset_size(ent->zset), start, stop)) {
+        return out_int(out, 0);
+    }
+    return zrem_range(out, ent, start, stop + 1);
+}
+
+// zremrangebyscore zset min max
+static void do_zremrangebyscore(std::vector<std::string_view> &cmd, std::string &out) {
+    double min = 0, max = 0;
+    bool minex = false, maxex = false;
+    if (!str2bound(cmd[2], min, minex) || !str2bound(cmd[3], max, maxex)) {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+    Entry *ent = NULL;
+    if (!expect_zset_int(out, cmd[1], &ent)) {
+        return;
+    }
+
+    uint64_t lo = zset_count_below(ent->zset, min, minex);
+    uint64_t hi = zset_count_below(ent->zset, max, !maxex);
+    return zrem_range(out, ent, lo, hi > lo ? hi : lo);
+}
+
+// zcount zset min max
+static void do_zcount(std::vector<std::string_view> &cmd, std::string &out) {
+    double min = 0, max = 0;
+    bool minex = false, maxex = false;
+    if (!str2bound(cmd[2], min, minex) || !str2bound(cmd[3], max, maxex)) {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+
+    Entry *ent = NULL;
+    if (!expect_zset_int(out, cmd[1], &ent)) {
+        return;
+    }
+    uint64_t n = zset_count(ent->zset, min, minex, max, maxex);
+    return out_int(out, (int64_t)n);
+}
+
+
+static void do_request(
+    std::vector<std::string_view> &cmd, std::string &out, Val **ref = NULL)
+{
+    if(cmd.size() == 1 && cmd_is(cmd[0], "keys")){
         do_keys(cmd,out);
+    }else if(cmd.size() == 1 && cmd_is(cmd[0], "stats")){
+        do_stats(cmd,out);
+    }else if(cmd.size() >= 2 && cmd_is(cmd[0], "scan")){
+        do_scan(cmd,out);
     }else if(cmd.size() == 2 && cmd_is(cmd[0], "get")){
-        do_get(cmd,out);
+        do_get(cmd,out,ref);
     }else if(cmd.size() == 3 && cmd_is(cmd[0], "set")){
         do_set(cmd,out);
     }else if(cmd.size() == 2 && cmd_is(cmd[0], "del")){
         do_del(cmd,out);
+    }else if(cmd.size() >= 2 && cmd_is(cmd[0], "mget")){
+        do_mget(cmd,out);
+    }else if(cmd.size() >= 3 && cmd.size() % 2 == 1 && cmd_is(cmd[0], "mset")){
+        do_mset(cmd,out);
+    }else if(cmd.size() >= 2 && cmd_is(cmd[0], "mdel")){
+        do_mdel(cmd,out);
     }else if(cmd.size() == 4 && cmd_is(cmd[0], "zadd")){
         do_zadd(cmd,out);
     }else if (cmd.size() == 3 && cmd_is(cmd[0], "zrem")) {
@@ -533,18 +1473,37 @@ static void do_request(std::vector<std::string> &cmd, std::string &out){
         do_zscore(cmd, out);
     } else if (cmd.size() == 6 && cmd_is(cmd[0], "zquery")) {
         do_zquery(cmd, out);
+    } else if (cmd.size() == 3 && cmd_is(cmd[0], "zrank")) {
+        do_zrank(cmd, out, false);
+    } else if (cmd.size() == 3 && cmd_is(cmd[0], "zrevrank")) {
+        do_zrank(cmd, out, true);
+    } else if (cmd.size() == 4 && cmd_is(cmd[0], "zcount")) {
+        do_zcount(cmd, out);
+    } else if (cmd.size() == 4 && cmd_is(cmd[0], "zrange")) {
+        do_zrange(cmd, out, false);
+    } else if (cmd.size() == 4 && cmd_is(cmd[0], "zrevrange")) {
+        do_zrange(cmd, out, true);
+    } else if ((cmd.size() == 4 || cmd.size() == 7) && cmd_is(cmd[0], "zrevrangebyscore")) {
+        do_zrevrangebyscore(cmd, out);
+    } else if (cmd.size() == 4 && cmd_is(cmd[0], "zremrangebyrank")) {
+        do_zremrangebyrank(cmd, out);
+    } else if (cmd.size() == 4 && cmd_is(cmd[0], "zremrangebyscore")) {
+        do_zremrangebyscore(cmd, out);
     } else{
         out_err(out, ERR_UNKNOWN, "Unknown cmd");
     }
 }
 
-static int32_t parse_req(const uint8_t* data, uint32_t len, std::vector<std::string> &out){
+// 参数只是指向data的视图，data在命令执行完之前不能被修改
+static int32_t parse_req(
+    const uint8_t* data, uint32_t len, std::vector<std::string_view> &out)
+{
     if(len < 4){
         return -1;
     }
     uint32_t n = 0;
     memcpy(&n, &data[0],4);
-    if(n > k_max_msg){
+    if(n > k_max_args){
         return -1;
     }
     size_t pos = 4;
@@ -557,7 +1516,7 @@ static int32_t parse_req(const uint8_t* data, uint32_t len, std::vector<std::str
         if(pos + 4 + sz > len){
             return -1;
         }
-        out.push_back(std::string((char *)&data[pos+4], sz));
+        out.emplace_back((const char *)&data[pos+4], sz);
         pos += 4 + sz;
         
     }
@@ -568,57 +1527,435 @@ static int32_t parse_req(const uint8_t* data, uint32_t len, std::vector<std::str
 }
 
 
+static Shard *shard_of(std::string_view key){
+    uint64_t h = str_hash((uint8_t *)key.data(), key.size());
+    // HMap用的是hash的低位，这里打散后取高位，避免同一分片的key挤在少数桶里
+    h = (h * 0x9E3779B97F4A7C15ull) >> 32;
+    return &g_keyspace.shards[h % g_keyspace.nshards];
+}
+
+static void shard_post(Shard *shard, ShardMsg *m){
+    ShardMsg *head = shard->inbox.load(std::memory_order_relaxed);
+    do{
+        m->next = head;
+    }while(!shard->inbox.compare_exchange_weak(head, m));
+    // 与shard_sleep配对: 要么对方能看到这条消息，要么这里能看到sleeping
+    if(shard->sleeping.load()){
+        uint64_t one = 1;
+        (void)!write(shard->wakefd, &one, sizeof(one));
+    }
+}
+
+static void conn_resume(Conn *conn);
+
+// 请求用过的大块空间不留在池里
+static void str_trim(std::string &s){
+    if(s.capacity() > k_iobuf_size){
+        std::string().swap(s);
+    }
+}
+
+static void shard_req_free(ShardReq *req){
+    val_unref(req->ref);
+    req->ref = NULL;
+    str_trim(req->data);
+    str_trim(req->out);
+    for(ShardMsg &m : req->msgs){
+        str_trim(m.out);
+    }
+    g_data.free_reqs.push_back(req);
+}
+
+// 拷贝一份请求，参数视图改为指向拷贝
+static ShardReq *shard_req_new(
+    Conn *conn, int kind, std::string_view raw, std::vector<std::string_view> &cmd)
+{
+    ShardReq *req = NULL;
+    if(g_data.free_reqs.empty()){
+        req = new ShardReq();
+        req->msgs.resize(g_keyspace.nshards);
+    }else{
+        req = g_data.free_reqs.back();
+        g_data.free_reqs.pop_back();
+    }
+    req->conn = conn;
+    req->kind = kind;
+    req->data.assign(raw);
+    req->cmd.clear();
+    for(std::string_view arg : cmd){
+        req->cmd.emplace_back(&req->data[arg.data() - raw.data()], arg.size());
+    }
+    for(ShardMsg &m : req->msgs){
+        m.req = req;
+        m.origin = g_data.shard;
+        m.reply = false;
+        m.cmd.clear();
+        m.out.clear();
+    }
+    req->owner.clear();
+    req->waiting = 0;
+    req->out.clear();
+    return req;
+}
+
+// 连接关闭时还有转发的请求，回复回来之后直接丢掉
+static void conn_fwd_drop(Conn *conn){
+    ShardReq *req = conn->fwd;
+    if(!req){
+        return;
+    }
+    conn->fwd = NULL;
+    req->conn = NULL;
+    if(req->waiting == 0){
+        shard_req_free(req);
+    }
+}
+
+// stats: 各分片回复的格式完全一样，把整数按位置合并到第一个分片的回复上
+// 名字以max_和last_开头的取最大值，其他的相加
+static void shard_stats(ShardReq *req){
+    std::string &sum = req->msgs[0].out;
+    size_t pos = 5;     // skip the array header
+    bool use_max = false;
+    while(pos < sum.size()){
+        if(sum[pos] == SER_STR){
+            uint32_t len = 0;
+            memcpy(&len, &sum[pos + 1], 4);
+            std::string_view name(&sum[pos + 5], len);
+            use_max = name.substr(0, 4) == "max_" || name.substr(0, 5) == "last_";
+            pos += 5 + len;
+            continue;
+        }
+        assert(sum[pos] == SER_INT);
+        int64_t total = 0;
+        for(const ShardMsg &m : req->msgs){
+            int64_t val = 0;
+            memcpy(&val, &m.out[pos + 1], 8);
+            total = use_max ? (val > total ? val : total) : total + val;
+        }
+        memcpy(&sum[pos + 1], &total, 8);
+        pos += 9;
+    }
+    req->out.swap(sum);
+}
+
+// keys: 每个分片各自生成一个数组，再合并
+static void shard_keys(ShardReq *req){
+    uint32_t total = 0;
+    for(const ShardMsg &m : req->msgs){
+        uint32_t n = 0;
+        memcpy(&n, &m.out[1], 4);
+        total += n;
+    }
+    out_arr(req->out, total);
+    for(const ShardMsg &m : req->msgs){
+        req->out.append(m.out, 5, std::string::npos);
+    }
+}
+
+// 回复中pos处一个标量值的长度
+static size_t ser_len(const std::string &s, size_t pos){
+    uint32_t len = 0;
+    switch(s[pos]){
+    case SER_NIL:
+        return 1;
+    case SER_STR:
+        memcpy(&len, &s[pos + 1], 4);
+        return 5 + len;
+    case SER_ERR:
+        memcpy(&len, &s[pos + 5], 4);
+        return 9 + len;
+    default:
+        assert(s[pos] == SER_INT || s[pos] == SER_DBL);
+        return 9;
+    }
+}
+
+// mget/mset/mdel: 按key原来的顺序合并各分片的回复
+static void shard_multi(ShardReq *req){
+    std::string &out = req->out;
+    if(cmd_is(req->cmd[0], "mset")){
+        return out_nil(out);
+    }
+    if(cmd_is(req->cmd[0], "mdel")){
+        int64_t total = 0;
+        for(const ShardMsg &m : req->msgs){
+            int64_t val = 0;
+            if(!m.out.empty()){
+                memcpy(&val, &m.out[1], 8);
+            }
+            total += val;
+        }
+        return out_int(out, total);
+    }
+    // mget: 从各分片的数组里依次取出下一个元素
+    std::vector<size_t> pos(req->msgs.size(), 5);   // skip the array header
+    out_arr(out, (uint32_t)req->owner.size());
+    for(uint32_t k : req->owner){
+        const std::string &part = req->msgs[k].out;
+        size_t len = ser_len(part, pos[k]);
+        out.append(part, pos[k], len);
+        pos[k] += len;
+    }
+}
+
+static void shard_merge(ShardReq *req){
+    switch(req->kind){
+    case FWD_KEYS:
+        return shard_keys(req);
+    case FWD_STATS:
+        return shard_stats(req);
+    case FWD_MULTI:
+        return shard_multi(req);
+    default:
+        for(ShardMsg &m : req->msgs){
+            if(!m.cmd.empty()){
+                req->out.swap(m.out);
+                req->ref = m.ref;
+                m.ref = NULL;
+            }
+        }
+    }
+}
+
+// 发起方收到一个子命令的回复，全部到齐之后合并，再接着处理等待的连接
+static void shard_reply(ShardReq *req){
+    assert(req->waiting > 0);
+    if(--req->waiting > 0){
+        return;
+    }
+    shard_merge(req);
+    if(!req->conn){
+        return shard_req_free(req);
+    }
+    // 正在发送之前的回复，发完之后由try_one_request取走
+    if(req->conn->state == STATE_REQ){
+        conn_resume(req->conn);
+    }
+}
+
+// 处理inbox: 其他线程投递过来的命令在本分片上执行，执行完投递回去；
+// 自己转发出去的命令的回复交给shard_reply
+static void shard_serve(){
+    ShardMsg *m = g_data.shard->inbox.exchange(NULL, std::memory_order_acquire);
+    while(m){
+        ShardMsg *next = m->next;   // 投递回去之后m随时可能被重用
+        if(m->reply){
+            shard_reply(m->req);
+        }else{
+            do_request(m->cmd, m->out, &m->ref);
+            m->reply = true;
+            shard_post(m->origin, m);
+        }
+        m = next;
+    }
+}
+
+// 阻塞等待IO之前调用，返回实际使用的超时
+static int shard_sleep(int timeout_ms){
+    g_data.shard->sleeping.store(true);
+    if(g_data.shard->inbox.load()){
+        return 0;
+    }
+    return timeout_ms;
+}
+
+static void shard_wake(){
+    g_data.shard->sleeping.store(false, std::memory_order_relaxed);
+    shard_serve();
+}
+
+static void shard_drain_wakefd(){
+    uint64_t cnt = 0;
+    (void)!read(g_data.shard->wakefd, &cnt, sizeof(cnt));
+}
+
+// 把子命令k投递给分片k，不等待回复
+static void shard_send(ShardReq *req, size_t k){
+    req->waiting++;
+    shard_post(&g_keyspace.shards[k], &req->msgs[k]);
+}
+
+// mget/mset/mdel按分片拆成子命令，stride是每个key占的参数个数
+static void shard_split(ShardReq *req, size_t stride){
+    std::vector<std::string_view> &cmd = req->cmd;
+    for(size_t i = 1; i < cmd.size(); i += stride){
+        size_t k = shard_of(cmd[i]) - g_keyspace.shards;
+        std::vector<std::string_view> &sub = req->msgs[k].cmd;
+        if(sub.empty()){
+            sub.push_back(cmd[0]);
+        }
+        sub.insert(sub.end(), &cmd[i], &cmd[i] + stride);
+        req->owner.push_back((uint32_t)k);
+    }
+}
+
+// 在key所属的分片上执行命令。返回false表示转发给了其他分片，不等待，
+// 回复到齐后由shard_serve合并好，再由try_one_request取走。
+// raw是整个请求，cmd里的视图都指向它
+static bool shard_request(Conn *conn, std::string_view raw,
+    std::vector<std::string_view> &cmd, std::string &out, Val **ref)
+{
+    size_t nshards = g_keyspace.nshards;
+    size_t self = g_data.shard - g_keyspace.shards;
+    int kind = FWD_ONE;
+    size_t stride = 0;
+    if(cmd.size() == 1 && cmd_is(cmd[0], "keys")){
+        kind = FWD_KEYS;
+    }else if(cmd.size() == 1 && cmd_is(cmd[0], "stats")){
+        kind = FWD_STATS;
+    }else if(cmd.size() >= 2 && (cmd_is(cmd[0], "mget") || cmd_is(cmd[0], "mdel"))){
+        kind = FWD_MULTI;
+        stride = 1;
+    }else if(cmd.size() >= 3 && cmd.size() % 2 == 1 && cmd_is(cmd[0], "mset")){
+        kind = FWD_MULTI;
+        stride = 2;
+    }
+
+    size_t target = self;
+    if(kind == FWD_ONE && cmd.size() >= 2){
+        target = shard_of(cmd[1]) - g_keyspace.shards;
+        int64_t cursor = 0;
+        if(cmd_is(cmd[0], "scan")){
+            // 游标里带着分片号，游标不合法时在本地回复错误
+            bool ok = str2int(cmd[1], cursor) && cursor >= 0;
+            target = ok ? (size_t)cursor % nshards : self;
+        }
+    }
+    bool local = nshards == 1 || (kind == FWD_ONE && target == self);
+    if(kind == FWD_MULTI){
+        local = true;
+        for(size_t i = 1; i < cmd.size() && local; i += stride){
+            local = shard_of(cmd[i]) == g_data.shard;
+        }
+    }
+    if(local){
+        do_request(cmd, out, ref);
+        return true;
+    }
+
+    ShardReq *req = shard_req_new(conn, kind, raw, cmd);
+    if(kind == FWD_ONE){
+        req->msgs[target].cmd = req->cmd;
+    }else if(kind == FWD_MULTI){
+        shard_split(req, stride);
+    }else{
+        for(ShardMsg &m : req->msgs){
+            m.cmd = req->cmd;
+        }
+    }
+    for(size_t k = 0; k < nshards; ++k){
+        if(k != self && !req->msgs[k].cmd.empty()){
+            shard_send(req, k);
+        }
+    }
+    // 自己的那部分直接执行，其他分片的回复在shard_serve里收
+    ShardMsg &mine = req->msgs[self];
+    if(!mine.cmd.empty()){
+        do_request(mine.cmd, mine.out);
+    }
+    conn->fwd = req;
+    return false;
+}
+
+// 把一个回复追加到之前还未发送的回复后面，由调用方统一发送
+// GET的value不拷贝，ref跟在out后面发送，引用归连接所有
+static void conn_reply(struct Conn *conn, std::string &out, Val *ref){
+    size_t vlen = ref ? ref->len : 0;
+    if(4 + out.size() + vlen > g_conf.max_msg){
+        val_unref(ref);
+        ref = NULL;
+        vlen = 0;
+        out.clear();
+        out_err(out, ERR_2BIG, "response is too big");
+    }
+    if(!conn->wbuf){
+        conn->wbuf = (WBuf *)iobuf_get();
+        conn->wbuf->cap = k_iobuf_size - sizeof(WBuf);
+    }
+    size_t need = conn->wbuf_size + 4 + out.size();
+    if(need > conn->wbuf->cap){
+        // 只有STATE_REQ才会走到这里，没有send引用着wbuf
+        size_t cap = sizeof(WBuf) + conn->wbuf->cap;
+        while(cap < sizeof(WBuf) + need){
+            cap *= 2;
+        }
+        conn->wbuf = (WBuf *)buf_realloc((uint8_t *)conn->wbuf, cap);
+        conn->wbuf->cap = cap - sizeof(WBuf);
+    }
+    uint8_t *res = &conn->wbuf->data[conn->wbuf_size];
+    uint32_t wlen = out.size() + vlen;  // 将rescode的长度也算上
+    memcpy(&res[0], &wlen, 4);   // 返回字符串长度
+    memcpy(&res[4], out.data(), out.size());// 返回的状态码
+    conn->wbuf_size += 4 + out.size();
+    if(ref){
+        conn->wbuf->wref[conn->nwref].off = conn->wbuf_size;
+        conn->wbuf->wref[conn->nwref].val = ref;
+        conn->nwref++;
+        conn->wval_size += vlen;
+    }
+}
+
 static bool try_one_request(struct Conn *conn){
-    if(conn->rbuf_size < 4){
+    if(conn->state != STATE_REQ || conn_out_full(conn)){
+        return false;
+    }
+    if(conn->fwd){
+        // 转发的请求回复之前不处理后面的请求，回复的顺序和请求一致
+        ShardReq *fwd = conn->fwd;
+        if(fwd->waiting){
+            return false;
+        }
+        conn->fwd = NULL;
+        conn_reply(conn, fwd->out, fwd->ref);
+        fwd->ref = NULL;
+        shard_req_free(fwd);
+        if(conn_out_full(conn)){
+            return false;
+        }
+    }
+    uint8_t *req = &conn->rbuf[conn->rbuf_start];
+    size_t unread = conn->rbuf_size - conn->rbuf_start;
+    if(unread < 4){
         // not enough data in the buffers 
         // 下一轮再进行
         return false;
     }
     uint32_t len = 0;
-    memcpy(&len, &(conn->rbuf[0]), 4);
-    if(len > k_max_msg){
+    memcpy(&len, req, 4);
+    if(len > g_conf.max_msg){
         msg("too long");
         conn->state = STATE_END;
         return false;
     }
-    if(4 + len > conn->rbuf_size){
+    if(4 + len > unread){
         // not enough data
         return false;
     }
     // parse the request
-    std::vector<std::string> cmd;
-    if(0 != parse_req(&conn->rbuf[4], len, cmd)){
+    std::vector<std::string_view> &cmd = g_data.cmd;
+    cmd.clear();
+    if(0 != parse_req(&req[4], len, cmd)){
         msg("bad req");
         conn->state = STATE_END;
         return false;
     }
     // got one request generate one response
-    std::string out;
-    do_request(cmd,out);
-    if(4 + out.size() > k_max_msg){
-        out.clear();
-        out_err(out, ERR_2BIG, "response is too big");
-    }
-    uint32_t wlen = out.size();  // 将rescode的长度也算上
-    memcpy(&conn->wbuf[0], &wlen, 4);   // 返回字符串长度
-    memcpy(&conn->wbuf[4], out.data(), out.size());// 返回的状态码
-    conn->wbuf_size = 4 + wlen;
+    std::string &out = g_data.out;
+    out.clear();
+    Val *ref = NULL;
+    bool done = shard_request(conn, std::string_view((char *)&req[4], len), cmd, out, &ref);
 
     // remove the request from the buffer.
-    // note: frequent memmove is inefficient.
-    // note: need better handling for production code.
-    size_t remain = conn->rbuf_size - 4 - len;
-    if (remain) {
-        memmove(conn->rbuf, &conn->rbuf[4 + len], remain);
+    // 只移动读游标，memmove推迟到rbuf_make_room
+    conn->rbuf_start += 4 + len;
+    if(!done){
+        return false;
     }
-    conn->rbuf_size = remain;
-
-    // change state
-    conn->state = STATE_RES;
-    state_res(conn);
+    conn_reply(conn, out, ref);
 
-    // continue the outer loop if the request was fully processed
-    return (conn->state == STATE_REQ);
+    // 输出队列达到高水位就先停下来
+    return !conn_out_full(conn);
 }
 
 const uint64_t k_idle_timeout_ms = 5 * 1000;
@@ -628,7 +1965,14 @@ static uint64_t get_monotonic_usec() {
     clock_gettime(CLOCK_MONOTONIC, &tv);
     return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
 }
+static bool rehash_pending(){
+    return g_conf.rehash_us && hm_rehash_left(&g_data.shard->db);
+}
+
 static uint32_t next_timer_ms(){
+    if(rehash_pending() || !g_data.shard->zgarbage.empty()){
+        return 0;   // 还有rehash或者释放要做，不要阻塞
+    }
     if(dlist_empty(&g_data.idle_list)){
         return 10000;
     }
@@ -643,14 +1987,48 @@ static uint32_t next_timer_ms(){
     return (uint32_t)((next_us - now_us) / 1000);
 }
 
+static void uring_conn_done(Conn *conn);
+
 static void conn_done(Conn *conn) {
+    if(g_conf.backend == BACKEND_URING){
+        return uring_conn_done(conn);
+    }
     g_data.fd2conn[conn->fd] = NULL;
     (void)close(conn->fd);
     dlist_detach(&conn->idle_list);
-    free(conn);
+    conn_buf_drop(conn);
+    conn_fwd_drop(conn);
+    conn_free(conn);
 }
 
 
+// 一次突发的写入之后可能就没有请求了，旧表不能一直留着
+// 每轮最多推进g_conf.rehash_us，忙的时候增删查本身也会推进
+static void process_rehash(){
+    if(!rehash_pending()){
+        return;
+    }
+    uint64_t start = get_monotonic_usec();
+    while(hm_rehash_step(&g_data.shard->db)
+        && get_monotonic_usec() - start < g_conf.rehash_us)
+    {}
+}
+
+// 每轮最多释放这么多个ZNode，节点分散在堆上，每个都是cache miss，
+// 这样一轮不超过1ms左右
+const size_t k_zfree_batch = 1024;
+
+static void process_zfree(){
+    std::vector<AVLNode *> &garbage = g_data.shard->zgarbage;
+    size_t budget = k_zfree_batch;
+    while(!garbage.empty() && budget > 0){
+        budget -= zset_free_some(&garbage.back(), budget);
+        if(!garbage.back()){
+            garbage.pop_back();
+        }
+    }
+}
+
 static void process_timers() {
     uint64_t now_us = get_monotonic_usec();
     while (!dlist_empty(&g_data.idle_list)) {
@@ -664,48 +2042,11 @@ static void process_timers() {
         printf("removing idle connection: %d\n", next->fd);
         conn_done(next);
     }
+    process_rehash();
+    process_zfree();
 }
 
-int main(){
-
-    dlist_init(&g_data.idle_list);
-    int fd = socket(AF_INET,SOCK_STREAM, 0);
-    // 创建文件描述符失败
-    if(fd < 0){
-        die("socket()");
-    }
-
-    // 最多一个server程序
-    int val = 1;
-    setsockopt(fd, SOL_SOCKET,SO_REUSEADDR, &val, sizeof(val));
-
-    // 绑定socket
-    // 0.0.0.0:1234
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(0);
-
-    int rv = bind(fd, (const sockaddr*) &addr, sizeof(addr));
-    // note: 这里不为 0 即失败
-    if(rv){
-        die("bind()");
-    }
-
-    // 监听窗口
-    rv = listen(fd,SOMAXCONN);
-    // note: 这里不为 0 即失败
-    if(rv){
-        die("listen()");
-    }   
-
-    // // a map for all client connection, key is fd
-    // std::vector<Conn*> fd2conn;
-
-    // 设置listen fd 为 nonblocking 模式
-    fd_set_nb(fd);
-
-    // the event loop
+static void run_poll(int fd){
     std::vector<struct pollfd> poll_args;
 
     while (true){
@@ -714,10 +2055,15 @@ int main(){
         // 为了方便将listen fd 放到首位
         struct pollfd pfd = {fd, POLLIN, 0};
         poll_args.push_back(pfd);
+        // 第二位是分片的eventfd
+        pfd = {g_data.shard->wakefd, POLLIN, 0};
+        poll_args.push_back(pfd);
 
         // connections fd
         for(Conn*  conn : g_data.fd2conn){
             if(!conn) continue;
+            // 在等其他分片的回复，回复到了由shard_wake接着处理
+            if(conn->state == STATE_REQ && conn->fwd) continue;
             struct pollfd pfd = {};
             pfd.fd = conn->fd;
             pfd.events = conn->state == STATE_REQ ? POLLIN : POLLOUT;
@@ -725,18 +2071,23 @@ int main(){
             poll_args.push_back(pfd);
         };
         
-        int timeout_ms = (int)next_timer_ms();
+        int timeout_ms = shard_sleep((int)next_timer_ms());
         // poll the activate fd
         // the timeout argument doesn't matter here
         int rv = poll(poll_args.data(),(nfds_t)poll_args.size(),timeout_ms);
         if(rv < 0){
             die("poll");
         }
+        if(poll_args[1].revents){
+            shard_drain_wakefd();
+        }
+        shard_wake();
 
         // process the connections
-        for(size_t i = 1; i < poll_args.size(); ++i){
-            if(poll_args[i].revents){
-                Conn *conn = g_data.fd2conn[poll_args[i].fd];
+        for(size_t i = 2; i < poll_args.size(); ++i){
+            Conn *conn = g_data.fd2conn[poll_args[i].fd];
+            // 可能已经在shard_wake里处理完关闭了
+            if(poll_args[i].revents && conn){
                 connection_io(conn);
                 if(conn->state == STATE_END){
                     // client 关闭连接,或者这个连接出现了错误
@@ -753,5 +2104,533 @@ int main(){
             accept_new_conn( fd);
         }
     }
+}
+
+// 状态在STATE_REQ和STATE_RES之间切换时才修改interest
+static void epoll_update(Conn *conn){
+    struct epoll_event ev = {};
+    ev.events = (conn->state == STATE_REQ ? EPOLLIN : EPOLLOUT) | EPOLLET;
+    ev.data.fd = conn->fd;
+    if(epoll_ctl(g_data.epfd, EPOLL_CTL_MOD, conn->fd, &ev)){
+        die("epoll_ctl()");
+    }
+}
+
+// 每次唤醒的开销只和就绪的fd数量有关，与连接总数无关
+static void run_epoll(int fd){
+    g_data.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(g_data.epfd < 0){
+        die("epoll_create1()");
+    }
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = fd;
+    if(epoll_ctl(g_data.epfd, EPOLL_CTL_ADD, fd, &ev)){
+        die("epoll_ctl()");
+    }
+    ev.data.fd = g_data.shard->wakefd;
+    if(epoll_ctl(g_data.epfd, EPOLL_CTL_ADD, ev.data.fd, &ev)){
+        die("epoll_ctl()");
+    }
+
+    const int k_max_events = 256;
+    struct epoll_event events[k_max_events];
+    while (true){
+        int timeout_ms = shard_sleep((int)next_timer_ms());
+        int rv = epoll_wait(g_data.epfd, events, k_max_events, timeout_ms);
+        if(rv < 0 && errno != EINTR){
+            die("epoll_wait");
+        }
+        shard_wake();
+
+        bool listen_ready = false;
+        for(int i = 0; i < rv; ++i){
+            int efd = events[i].data.fd;
+            if(efd == fd){
+                listen_ready = true;
+                continue;
+            }
+            if(efd == g_data.shard->wakefd){
+                shard_drain_wakefd();
+                continue;
+            }
+            Conn *conn = g_data.fd2conn[efd];
+            if(!conn){
+                continue;   // 已经在shard_wake里处理完关闭了
+            }
+            uint32_t old_state = conn->state;
+            connection_io(conn);
+            if(conn->state == STATE_END){
+                // close() 会自动将fd从epoll中移除
+                conn_done(conn);
+            }else if(conn->state != old_state){
+                epoll_update(conn);
+            }
+        }
+
+        // handle timers
+        process_timers();
+        // 边沿触发，需要一直accept直到EAGAIN
+        if(listen_ready){
+            while(accept_new_conn(fd) == 0) {}
+        }
+    }
+}
+
+// io_uring的user_data: Conn指针低位存放操作类型，Conn由malloc分配至少8字节对齐
+enum{
+    OP_ACCEPT = 1,
+    OP_RECV = 2,
+    OP_SEND = 3,
+    OP_IGNORE = 4,  // cancel等不关心结果的操作
+    OP_WAKE = 5,    // 分片的eventfd可读
+};
+const uint64_t k_op_mask = 7;
+const uint32_t k_uring_entries = 1024;
+const uint16_t k_uring_nbufs = 1024;
+const uint32_t k_uring_buf_size = 4 + 4096;
+// 积压的输入超过这个值就暂停recv
+const size_t k_uring_max_ovf = 1 << 20;
+
+static io_uring_sqe *uring_sqe(){
+    io_uring_sqe *sqe = uring_get_sqe(&g_data.ring);
+    if(!sqe){
+        // SQ满了，先提交一次
+        if(uring_submit_and_wait(&g_data.ring, 0, -1) < 0){
+            die("io_uring_enter");
+        }
+        sqe = uring_get_sqe(&g_data.ring);
+        assert(sqe);
+    }
+    return sqe;
+}
+
+static void uring_accept(int fd){
+    io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = OP_ACCEPT;
+}
+
+static void uring_recv(Conn *conn){
+    io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = g_data.bufs.bgid;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | OP_RECV;
+    conn->recv_armed = true;
+    conn->inflight++;
+}
+
+static void uring_send(Conn *conn){
+    WBuf *wbuf = conn->wbuf;
+    memset(&wbuf->msg, 0, sizeof(wbuf->msg));
+    wbuf->msg.msg_iov = wbuf->iov;
+    wbuf->msg.msg_iovlen = conn_out_iov(conn, wbuf->iov);
+    io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&wbuf->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | OP_SEND;
+    conn->inflight++;
+}
+
+static void uring_poll_wakefd(){
+    io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = g_data.shard->wakefd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = OP_WAKE;
+}
+
+// 取消这个fd上所有未完成的操作
+static void uring_cancel(Conn *conn){
+    io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = conn->fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = OP_IGNORE;
+}
+
+// 只取消multishot recv，按user_data匹配，正在进行的send不受影响
+static void uring_cancel_recv(Conn *conn){
+    io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)conn | OP_RECV;
+    sqe->user_data = OP_IGNORE;
+}
+
+// 先取消未完成的操作，等所有CQE都回来才能close和free
+static void uring_conn_done(Conn *conn){
+    if(!conn->closing){
+        conn->closing = true;
+        conn->state = STATE_END;
+        dlist_detach(&conn->idle_list);
+        if(conn->inflight){
+            uring_cancel(conn);
+        }
+    }
+    if(conn->inflight){
+        return;
+    }
+    g_data.fd2conn[conn->fd] = NULL;
+    (void)close(conn->fd);
+    conn_buf_drop(conn);
+    conn_fwd_drop(conn);
+    conn_free(conn);
+}
+
+// 把ovf里积压的数据搬进rbuf，返回搬了多少字节
+static size_t uring_fill(Conn *conn){
+    size_t n = conn->ovf_size - conn->ovf_pos;
+    if(n == 0){
+        return 0;
+    }
+    rbuf_make_room(conn, 0);
+    size_t cap = conn->rbuf_cap - conn->rbuf_size;
+    n = n < cap ? n : cap;
+    memcpy(&conn->rbuf[conn->rbuf_size], &conn->ovf[conn->ovf_pos], n);
+    conn->rbuf_size += n;
+    conn->ovf_pos += n;
+    if(conn->ovf_pos == conn->ovf_size){
+        conn->ovf_pos = conn->ovf_size = 0;
+    }
+    return n;
+}
+
+// 处理请求直到需要等待send或者转发完成。先处理rbuf里已有的请求，
+// 没有完整的请求了才从ovf补充，rbuf里还有请求时不搬动也不补充
+static void uring_feed(Conn *conn){
+    while(conn->state == STATE_REQ){
+        while(try_one_request(conn)) {}
+        if(conn->state != STATE_REQ || conn_out_full(conn) || conn->fwd
+            || uring_fill(conn) == 0)
+        {
+            break;
+        }
+    }
+    // 这一批请求的回复合并成一次send，完成之前不再处理新的请求
+    if(conn->state == STATE_REQ && conn->wbuf_size > 0 && !conn_fwd_waiting(conn)){
+        conn->state = STATE_RES;
+        uring_send(conn);
+    }
+    // 积压已经消化，恢复接收
+    if(conn->state != STATE_END && !conn->recv_armed
+        && conn->ovf_size - conn->ovf_pos < k_uring_max_ovf)
+    {
+        uring_recv(conn);
+    }
+    if(conn->state == STATE_REQ && conn->wbuf_size == 0){
+        conn_buf_release(conn);
+    }
+}
+
+// 转发到其他分片的请求有了回复，接着处理这个连接后面的请求
+static void conn_resume(Conn *conn){
+    conn_touch(conn);
+    if(g_conf.backend == BACKEND_URING){
+        uring_feed(conn);
+    }else{
+        uint32_t old_state = conn->state;
+        state_req(conn);
+        if(g_conf.backend == BACKEND_EPOLL
+            && conn->state != old_state && conn->state != STATE_END)
+        {
+            epoll_update(conn);
+        }
+    }
+    if(conn->state == STATE_END){
+        conn_done(conn);
+    }
+}
+
+// rbuf放不下的数据接在ovf后面
+static void uring_ovf_append(Conn *conn, const uint8_t *data, size_t len){
+    if(!conn->ovf){
+        conn->ovf = iobuf_get();
+        conn->ovf_cap = k_iobuf_size;
+    }
+    if(conn->ovf_size + len > conn->ovf_cap){
+        // 先丢掉已经消费的部分
+        size_t remain = conn->ovf_size - conn->ovf_pos;
+        memmove(conn->ovf, &conn->ovf[conn->ovf_pos], remain);
+        conn->ovf_size = remain;
+        conn->ovf_pos = 0;
+    }
+    if(conn->ovf_size + len > conn->ovf_cap){
+        size_t cap = conn->ovf_cap;
+        while(cap < conn->ovf_size + len){
+            cap *= 2;
+        }
+        conn->ovf = buf_realloc(conn->ovf, cap);
+        conn->ovf_cap = cap;
+    }
+    memcpy(&conn->ovf[conn->ovf_size], data, len);
+    conn->ovf_size += len;
+}
+
+// 没有积压时直接放进rbuf的空闲部分，放不下的才存到ovf
+static void uring_on_recv(Conn *conn, const uint8_t *data, size_t len){
+    if(conn->ovf_pos == conn->ovf_size){
+        rbuf_make_room(conn, 0);
+        size_t cap = conn->rbuf_cap - conn->rbuf_size;
+        size_t n = len < cap ? len : cap;
+        memcpy(&conn->rbuf[conn->rbuf_size], data, n);
+        conn->rbuf_size += n;
+        data += n;
+        len -= n;
+    }
+    if(len > 0){
+        uring_ovf_append(conn, data, len);
+    }
+    if(conn->state == STATE_REQ){
+        uring_feed(conn);
+    }
+    if(conn->recv_armed && conn->ovf_size - conn->ovf_pos >= k_uring_max_ovf){
+        // 客户端发得太快，暂停接收，由uring_feed恢复
+        uring_cancel_recv(conn);
+    }
+}
+
+static void uring_on_cqe(int fd, io_uring_cqe *cqe){
+    uint64_t op = cqe->user_data & k_op_mask;
+    Conn *conn = (Conn *)(uintptr_t)(cqe->user_data & ~k_op_mask);
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    switch(op){
+    case OP_ACCEPT:
+        if(cqe->res >= 0){
+            Conn *conn = conn_new(cqe->res);
+            if(conn){
+                uring_recv(conn);
+            }
+        }else{
+            msg("accept() error");
+        }
+        if(!more){
+            uring_accept(fd);
+        }
+        return;
+    case OP_WAKE:
+        shard_drain_wakefd();
+        if(!more){
+            uring_poll_wakefd();
+        }
+        return;
+    case OP_RECV:
+        if(!more){
+            conn->recv_armed = false;
+            conn->inflight--;
+        }
+        if(cqe->res > 0){
+            uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if(conn->state != STATE_END){
+                conn_touch(conn);
+                uring_on_recv(conn, uring_buf(&g_data.bufs, bid), cqe->res);
+            }
+            uring_buf_recycle(&g_data.bufs, bid);
+        }else if(cqe->res == 0){
+            if(conn->rbuf_size > conn->rbuf_start){
+                msg("unexpected EOF");
+            }else{
+                msg("EOF");
+            }
+            conn->state = STATE_END;
+        }else if(cqe->res == -ENOBUFS || cqe->res == -ECANCELED){
+            // 缓冲区耗尽或被暂停，稍后重新提交
+        }else{
+            msg("recv() error");
+            conn->state = STATE_END;
+        }
+        if(!more && conn->state == STATE_REQ){
+            uring_feed(conn);
+        }
+        break;
+    case OP_SEND:
+        conn->inflight--;
+        if(conn->state == STATE_END){
+            break;
+        }
+        if(cqe->res < 0){
+            msg("write() error");
+            conn->state = STATE_END;
+            break;
+        }
+        conn->wbuf_sent += (size_t)cqe->res;
+        assert(conn->wbuf_sent <= conn->wbuf_size + conn->wval_size);
+        if(conn->wbuf_sent < conn->wbuf_size + conn->wval_size){
+            uring_send(conn);
+            break;
+        }
+        // response was fully sent, change state back
+        conn->state = STATE_REQ;
+        conn_out_reset(conn);
+        uring_feed(conn);
+        break;
+    default:
+        return;
+    }
+    if(conn->state == STATE_END){
+        conn_done(conn);
+    }
+}
+
+// 完成事件全部在用户态处理，新产生的SQE在下一轮和等待合并为一次io_uring_enter
+static void run_uring(int fd){
+    if(uring_init(&g_data.ring, k_uring_entries)){
+        die("io_uring_setup()");
+    }
+    if(uring_setup_buf_ring(
+        &g_data.ring, &g_data.bufs, 0, k_uring_nbufs, k_uring_buf_size))
+    {
+        die("io_uring_register()");
+    }
+    uring_accept(fd);
+    uring_poll_wakefd();
+
+    while (true){
+        int timeout_ms = shard_sleep((int)next_timer_ms());
+        if(uring_submit_and_wait(&g_data.ring, 1, timeout_ms) < 0){
+            die("io_uring_enter");
+        }
+        shard_wake();
+        while(io_uring_cqe *cqe = uring_peek_cqe(&g_data.ring)){
+            io_uring_cqe copy = *cqe;
+            uring_cqe_seen(&g_data.ring);
+            uring_on_cqe(fd, &copy);
+        }
+
+        // handle timers
+        process_timers();
+    }
+}
+
+static int listen_socket(){
+    int fd = socket(AF_INET,SOCK_STREAM, 0);
+    // 创建文件描述符失败
+    if(fd < 0){
+        die("socket()");
+    }
+
+    // 最多一个server程序
+    int val = 1;
+    setsockopt(fd, SOL_SOCKET,SO_REUSEADDR, &val, sizeof(val));
+    if(g_conf.nthreads > 1){
+        // 每个线程一个listen fd，由内核在它们之间分配新连接
+        if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val))){
+            die("setsockopt(SO_REUSEPORT)");
+        }
+    }
+
+    // 绑定socket
+    // 0.0.0.0:1234
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs(1234);
+    addr.sin_addr.s_addr = ntohl(0);
+
+    int rv = bind(fd, (const sockaddr*) &addr, sizeof(addr));
+    // note: 这里不为 0 即失败
+    if(rv){
+        die("bind()");
+    }
+
+    // 监听窗口
+    rv = listen(fd,SOMAXCONN);
+    // note: 这里不为 0 即失败
+    if(rv){
+        die("listen()");
+    }   
+
+    // 设置listen fd 为 nonblocking 模式
+    fd_set_nb(fd);
+    return fd;
+}
+
+// 一个线程一个事件循环和一个keyspace分片，互不共享
+static void reactor_main(int fd, int id){
+    g_data.shard = &g_keyspace.shards[id];
+    dlist_init(&g_data.idle_list);
+    if(g_conf.backend == BACKEND_EPOLL){
+        run_epoll(fd);
+    }else if(g_conf.backend == BACKEND_URING){
+        run_uring(fd);
+    }else{
+        run_poll(fd);
+    }
+}
+
+// usage: ./server [--poll|--epoll|--uring] [--threads N] [--out-hwm BYTES]
+int main(int argc, char **argv){
+    for(int i = 1; i < argc; ++i){
+        if(0 == strcmp(argv[i], "--poll")){
+            g_conf.backend = BACKEND_POLL;
+        }else if(0 == strcmp(argv[i], "--epoll")){
+            g_conf.backend = BACKEND_EPOLL;
+        }else if(0 == strcmp(argv[i], "--uring")){
+            g_conf.backend = BACKEND_URING;
+        }else if(0 == strcmp(argv[i], "--threads") && i + 1 < argc){
+            g_conf.nthreads = atoi(argv[++i]);
+        }else if(0 == strcmp(argv[i], "--out-hwm") && i + 1 < argc){
+            g_conf.out_hwm = strtoull(argv[++i], NULL, 10);
+            if(g_conf.out_hwm == 0){
+                g_conf.nthreads = 0;
+                break;
+            }
+        }else if(0 == strcmp(argv[i], "--rehash-us") && i + 1 < argc){
+            g_conf.rehash_us = strtoull(argv[++i], NULL, 10);
+        }else if(0 == strcmp(argv[i], "--max-msg") && i + 1 < argc){
+            // 长度字段是uint32_t
+            g_conf.max_msg = strtoull(argv[++i], NULL, 10);
+            if(g_conf.max_msg == 0 || g_conf.max_msg > (1u << 30)){
+                g_conf.nthreads = 0;
+                break;
+            }
+        }else{
+            g_conf.nthreads = 0;    // print usage
+            break;
+        }
+    }
+    if(g_conf.nthreads < 1){
+        fprintf(stderr,
+            "usage: %s [--poll|--epoll|--uring] [--threads N] [--out-hwm BYTES]"
+            " [--max-msg BYTES] [--rehash-us N]\n",
+            argv[0]);
+        return 1;
+    }
+
+    // 客户端不等回复就断开时writev会触发SIGPIPE，按write() error处理
+    signal(SIGPIPE, SIG_IGN);
+
+    // 启动线程之前设置好，所有分片用同一个种子
+    if(getrandom(&g_hash_seed, sizeof(g_hash_seed), 0) != sizeof(g_hash_seed)){
+        die("getrandom()");
+    }
+
+    g_keyspace.nshards = g_conf.nthreads;
+    g_keyspace.shards = new Shard[g_keyspace.nshards];
+    for(size_t i = 0; i < g_keyspace.nshards; ++i){
+        g_keyspace.shards[i].db.stats = &g_keyspace.shards[i].db_stats;
+        g_keyspace.shards[i].wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(g_keyspace.shards[i].wakefd < 0){
+            die("eventfd()");
+        }
+    }
+
+    // 所有listen fd都在启动线程之前绑定好
+    std::vector<int> fds;
+    for(int i = 0; i < g_conf.nthreads; ++i){
+        fds.push_back(listen_socket());
+    }
+    std::vector<std::thread> threads;
+    for(int i = 1; i < g_conf.nthreads; ++i){
+        threads.emplace_back(reactor_main, fds[i], i);
+    }
+    reactor_main(fds[0], 0);
     return 0;   
-}
\ No newline at end of file
+}
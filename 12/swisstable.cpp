@@ -0,0 +1,205 @@
+#include "swisstable.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <emmintrin.h>  // SSE2
+
+// 控制字节: 最高位为1表示槽位有节点，低7位是tag
+// 空槽位是0，新表直接calloc，大表的页面在第一次访问时才清零
+const int8_t k_ctrl_empty = 0;
+const int8_t k_ctrl_deleted = 1;
+// 一组16个槽位，对应一次SSE2比较
+const size_t k_group = 16;
+const size_t k_npos = (size_t)-1;
+
+// 组号用hcode的低位(和HMap一样)，tag取打散之后的高7位
+static int8_t h_tag(uint64_t hcode){
+    return (int8_t)(0x80 | ((hcode * 0x9E3779B97F4A7C15ull) >> 57));
+}
+
+// 组内等于c的控制字节
+static uint32_t g_match(const int8_t *ctrl, int8_t c){
+    __m128i g = _mm_load_si128((const __m128i *)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+}
+
+// 组内空的或者已删除的槽位
+static uint32_t g_match_free(const int8_t *ctrl){
+    return ~_mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl)) & 0xFFFF;
+}
+
+static void s_init(STab *stab, size_t n){
+    assert(n >= k_group && ((n - 1) & n) == 0);  // 确保是2的幂
+    // malloc返回的地址是16字节对齐的
+    stab->ctrl = (int8_t *)calloc(n, 1);
+    // 控制字节为空的槽位不会被读，不需要清零
+    stab->slots = (HNode **)malloc(n * sizeof(HNode *));
+    stab->mask = n - 1;
+    stab->size = 0;
+    stab->tombs = 0;
+}
+
+static void s_free(STab *stab){
+    free(stab->ctrl);
+    free(stab->slots);
+    *stab = STab{};
+}
+
+// 装载因子7/8，删除标记也算在内
+static bool s_full(STab *stab){
+    return (stab->size + stab->tombs + 1) * 8 > (stab->mask + 1) * 7;
+}
+
+// 按组做三角探测，组数是2的幂时能访问到所有的组
+// 遇到有空槽位的组说明key不存在
+static size_t s_lookup(STab *stab, HNode *key, bool (*cmp)(HNode *, HNode *)){
+    if(!stab->ctrl || stab->size == 0){
+        return k_npos;
+    }
+    size_t gmask = stab->mask / k_group;
+    size_t g = key->hcode & gmask;
+    int8_t tag = h_tag(key->hcode);
+    for(size_t step = 1; step <= gmask + 1; ++step){
+        const int8_t *ctrl = &stab->ctrl[g * k_group];
+        uint32_t bits = g_match(ctrl, tag);
+        while(bits){
+            size_t pos = g * k_group + __builtin_ctz(bits);
+            HNode *node = stab->slots[pos];
+            if(node->hcode == key->hcode && cmp(node, key)){
+                return pos;
+            }
+            bits &= bits - 1;
+        }
+        if(g_match(ctrl, k_ctrl_empty)){
+            return k_npos;
+        }
+        g = (g + step) & gmask;
+    }
+    return k_npos;
+}
+
+// 放进探测序列上第一个空闲的槽位，调用方保证表没有满
+static void s_insert(STab *stab, HNode *node){
+    size_t gmask = stab->mask / k_group;
+    size_t g = node->hcode & gmask;
+    for(size_t step = 1; ; ++step){
+        uint32_t bits = g_match_free(&stab->ctrl[g * k_group]);
+        if(bits){
+            size_t pos = g * k_group + __builtin_ctz(bits);
+            if(stab->ctrl[pos] == k_ctrl_deleted){
+                stab->tombs--;
+            }
+            stab->ctrl[pos] = h_tag(node->hcode);
+            stab->slots[pos] = node;
+            stab->size++;
+            return;
+        }
+        g = (g + step) & gmask;
+    }
+}
+
+// 同一组里已经有空槽位时，探测本来就会停在这一组，可以直接置空
+// 否则要留下删除标记，不能截断经过这一组的探测序列
+static HNode *s_detach(STab *stab, size_t pos){
+    const int8_t *ctrl = &stab->ctrl[pos & ~(k_group - 1)];
+    if(g_match(ctrl, k_ctrl_empty)){
+        stab->ctrl[pos] = k_ctrl_empty;
+    }else{
+        stab->ctrl[pos] = k_ctrl_deleted;
+        stab->tombs++;
+    }
+    stab->size--;
+    return stab->slots[pos];
+}
+
+// 一轮最多检查128个槽位，空槽位也算，这样每次操作的开销有上限
+const size_t k_resizing_work = 128;
+
+// 由ht2转移到ht1
+static void sm_help_resizing(SMap *smap){
+    if(smap->ht2.ctrl == NULL){
+        return;
+    }
+    size_t nwork = 0;
+    while(nwork < k_resizing_work && smap->ht2.size > 0){
+        size_t pos = smap->resizing_pos++;
+        if(smap->ht2.ctrl[pos] < 0){
+            s_insert(&smap->ht1, s_detach(&smap->ht2, pos));
+        }
+        nwork++;
+    }
+    // 清理内存
+    if(smap->ht2.size == 0){
+        s_free(&smap->ht2);
+    }
+}
+
+static void sm_start_resizing(SMap *smap){
+    assert(smap->ht2.ctrl == NULL);
+    size_t n = smap->ht1.mask + 1;
+    // 主要是删除标记的话，原大小重建一次就够了
+    if(smap->ht1.size * 16 >= n * 7){
+        n <<= 1;
+    }
+    smap->ht2 = smap->ht1;
+    s_init(&smap->ht1, n);
+    smap->resizing_pos = 0;
+}
+
+// 寻找一个节点
+HNode *sm_lookup(SMap *smap, HNode *key, bool (*cmp)(HNode *, HNode *)){
+    sm_help_resizing(smap);
+    size_t pos = s_lookup(&smap->ht1, key, cmp);
+    if(pos != k_npos){
+        return smap->ht1.slots[pos];
+    }
+    pos = s_lookup(&smap->ht2, key, cmp);
+    return pos != k_npos ? smap->ht2.slots[pos] : NULL;
+}
+
+// 删除一个节点
+HNode *sm_pop(SMap *smap, HNode *key, bool (*cmp)(HNode *, HNode *)){
+    sm_help_resizing(smap);
+    size_t pos = s_lookup(&smap->ht1, key, cmp);
+    if(pos != k_npos){
+        return s_detach(&smap->ht1, pos);
+    }
+    pos = s_lookup(&smap->ht2, key, cmp);
+    if(pos != k_npos){
+        return s_detach(&smap->ht2, pos);
+    }
+    return NULL;
+}
+
+// 插入节点
+void sm_insert(SMap *smap, HNode *node){
+    if(!smap->ht1.ctrl){
+        s_init(&smap->ht1, k_group);
+    }
+    if(s_full(&smap->ht1)){
+        // 上一次扩容还没完成，新表至少有一半是空的，正常情况下不会发生
+        while(smap->ht2.ctrl){
+            sm_help_resizing(smap);
+        }
+        sm_start_resizing(smap);
+    }
+    s_insert(&smap->ht1, node);
+    sm_help_resizing(smap);
+}
+
+void sm_destroy(SMap *smap){
+    assert(smap->ht1.size + smap->ht2.size == 0);
+    s_free(&smap->ht1);
+    s_free(&smap->ht2);
+    *smap = SMap{};
+}
+
+// 节点由调用方自行释放，这里只丢弃槽位数组
+void sm_clear(SMap *smap){
+    s_free(&smap->ht1);
+    s_free(&smap->ht2);
+    *smap = SMap{};
+}
+
+size_t sm_size(SMap *smap){
+    return smap->ht1.size + smap->ht2.size;
+}
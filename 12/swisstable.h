@@ -0,0 +1,29 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "hashtable.h"
+
+// 开放寻址的hashtable, 节点仍然是侵入式的HNode(不使用next)
+// 每个槽位有一个控制字节: 空, 已删除, 或者hash的7位tag
+// 查找时用SSE2一次比较16个控制字节，只有tag相同才去访问节点
+struct STab{
+    int8_t *ctrl = NULL;    // mask + 1 个控制字节，16字节对齐
+    HNode **slots = NULL;
+    size_t mask = 0;
+    size_t size = 0;
+    size_t tombs = 0;       // 已删除的槽位，同样占用探测序列
+};
+
+// 和HMap一样用2个表渐进式扩容, 由ht2转移到ht1
+struct SMap{
+    STab ht1;
+    STab ht2;
+    size_t resizing_pos = 0;
+};
+
+HNode *sm_lookup(SMap *smap, HNode *key, bool (*cmp)(HNode *, HNode *));
+HNode *sm_pop(SMap *smap, HNode *key, bool (*cmp)(HNode *, HNode *));
+void sm_insert(SMap *smap, HNode *node);
+void sm_destroy(SMap *smap);
+void sm_clear(SMap *smap);
+size_t sm_size(SMap *smap);
@@ -0,0 +1,275 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <set>
+#include "hashtable.cpp"  // lazy
+
+
+#define container_of(ptr, type, member) ({                  \
+    const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
+    (type *)( (char *)__mptr - offsetof(type, member) );})
+
+
+struct Data {
+    HNode node;
+    uint32_t val = 0;
+};
+
+static bool data_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, Data, node)->val == container_of(rhs, Data, node)->val;
+}
+
+static uint64_t hash(uint32_t val) {
+    return (uint64_t)val * 0x9E3779B97F4A7C15ull;
+}
+
+static void add(HMap &m, uint32_t val) {
+    Data *data = new Data();
+    data->val = val;
+    data->node.hcode = hash(val);
+    hm_insert(&m, &data->node);
+}
+
+static bool has(HMap &m, uint32_t val) {
+    Data key;
+    key.val = val;
+    key.node.hcode = hash(val);
+    return hm_lookup(&m, &key.node, &data_eq) != NULL;
+}
+
+static bool del(HMap &m, uint32_t val) {
+    Data key;
+    key.val = val;
+    key.node.hcode = hash(val);
+    HNode *node = hm_pop(&m, &key.node, &data_eq);
+    if (!node) {
+        return false;
+    }
+    delete container_of(node, Data, node);
+    return true;
+}
+
+static size_t nbuckets(HMap &m) {
+    return (m.ht1.tab ? m.ht1.mask + 1 : 0) + (m.ht2.tab ? m.ht2.mask + 1 : 0);
+}
+
+static void hmap_verify(HMap &m, const std::set<uint32_t> &ref, uint32_t range) {
+    assert(hm_size(&m) == ref.size());
+    for (uint32_t val = 0; val < range; ++val) {
+        assert(has(m, val) == (ref.count(val) > 0));
+    }
+}
+
+static void scan_cb(HNode *node, void *arg) {
+    ((std::multiset<uint32_t> *)arg)->insert(container_of(node, Data, node)->val);
+}
+
+// 一边遍历一边插入或删除 [lo, hi) 之外的key，遍历前后一直存在的key
+// 都要至少出现一次，重复的数量不能太多
+static void scan_verify(HMap &m, std::set<uint32_t> &ref,
+    uint32_t lo, uint32_t hi, bool grow)
+{
+    std::multiset<uint32_t> seen;
+    uint64_t cursor = 0;
+    uint32_t next = 10 * hi;
+    size_t total = hm_size(&m);
+    do {
+        cursor = hm_scan(&m, cursor, &scan_cb, &seen);
+        for (int i = 0; i < 16; ++i) {
+            if (grow) {
+                add(m, next);
+                ref.insert(next++);
+            } else if (!ref.empty() && *ref.rbegin() >= hi) {
+                uint32_t val = *ref.rbegin();
+                assert(del(m, val));
+                ref.erase(val);
+            }
+        }
+    } while (cursor != 0);
+    for (uint32_t val = lo; val < hi; ++val) {
+        assert(seen.count(val) >= 1);
+    }
+    assert(seen.size() <= 2 * (total + next - 10 * hi));
+}
+
+struct DataTr {
+    typedef Data T;
+    typedef uint32_t Key;
+    static const size_t offset = offsetof(Data, node);
+    static uint64_t hash(uint32_t val) { return ::hash(val); }
+    static bool eq(Data *data, uint32_t val) { return data->val == val; }
+};
+
+// 批量查找和逐个查找的结果要一样，包括rehash进行中的时候
+static void lookup_many_verify(HMap &m, const std::set<uint32_t> &ref, uint32_t range) {
+    const size_t n = 37;    // 不是批大小的整数倍
+    uint32_t keys[n];
+    uint64_t hcodes[n];
+    Data *out[n];
+    for (uint32_t base = 0; base < range; base += n) {
+        for (size_t i = 0; i < n; ++i) {
+            keys[i] = (base + i * 7919) % range;
+        }
+        hm_lookup_many<DataTr>(&m, n, keys, hcodes, out);
+        for (size_t i = 0; i < n; ++i) {
+            assert(hcodes[i] == hash(keys[i]));
+            assert((out[i] != NULL) == (ref.count(keys[i]) > 0));
+            assert(!out[i] || out[i]->val == keys[i]);
+        }
+    }
+}
+
+static void test_lookup_many() {
+    HMap m;
+    std::set<uint32_t> ref;
+    const uint32_t N = 20000;
+    for (uint32_t i = 0; i < N; ++i) {
+        add(m, i * 2);
+        ref.insert(i * 2);
+        if (i % 1009 == 0 || (m.ht2.tab && i % 61 == 0)) {
+            lookup_many_verify(m, ref, 2 * N);
+        }
+    }
+    for (uint32_t i = 0; i < N; i += 2) {
+        assert(del(m, i * 2));
+        ref.erase(i * 2);
+        if (i % 1009 == 0 || (m.ht2.tab && i % 61 == 0)) {
+            lookup_many_verify(m, ref, 2 * N);
+        }
+    }
+    for (uint32_t val : ref) {
+        assert(del(m, val));
+    }
+    hm_destroy(&m);
+}
+
+static void test_stats() {
+    HMap m;
+    HStats st;
+    m.stats = &st;
+    for (uint32_t i = 0; i < 1000; ++i) {
+        add(m, i);
+    }
+    while (hm_rehash_step(&m)) {}
+    assert(st.resizes > 0 && st.last_resize_ns > 0);
+    assert(st.resize_ns >= st.max_resize_step_ns);
+    for (uint32_t i = 0; i < 2000; ++i) {
+        assert(has(m, i) == (i < 1000));
+    }
+    assert(st.lookups == 2000);
+    uint64_t total = 0;
+    for (uint64_t n : st.probe_hist) {
+        total += n;
+    }
+    assert(total == st.lookups);
+    assert(st.probes >= 1000 && st.max_probes >= 1);
+    for (uint32_t i = 0; i < 1000; ++i) {
+        assert(del(m, i));
+    }
+    hm_destroy(&m);
+    assert(m.stats == &st);
+}
+
+static void test_scan() {
+    HMap m;
+    std::set<uint32_t> ref;
+    const uint32_t N = 100000;
+    for (uint32_t i = 0; i < N; ++i) {
+        add(m, i);
+        ref.insert(i);
+    }
+    // 遍历期间表在扩大
+    scan_verify(m, ref, 0, N, true);
+    // 遍历期间表在缩小
+    while (m.ht2.tab) {
+        has(m, 0);
+    }
+    size_t before = nbuckets(m);
+    scan_verify(m, ref, 0, N / 64, false);
+    assert(nbuckets(m) < before);
+    hmap_verify(m, ref, N);
+    for (uint32_t val : ref) {
+        assert(del(m, val));
+    }
+    hm_destroy(&m);
+}
+
+// 桶数组大到用mmap分配、转移过程中逐步归还旧表，查找都不能受影响
+static void test_big() {
+    const uint32_t N = (1 << 22) + 1;   // 最后一个key让表从4MB扩到8MB
+    Data *data = new Data[N];
+    HMap m;
+    for (uint32_t i = 0; i < N; ++i) {
+        data[i].val = i;
+        data[i].node.hcode = hash(i);
+        hm_insert(&m, &data[i].node);
+    }
+    assert(m.ht2.tab && (m.ht2.mask + 1) * sizeof(HNode *) == 4 << 20);
+    for (uint32_t i = 0; m.ht2.tab; i = (i + 7919) % N) {
+        assert(hm_lookup<DataTr>(&m, i) == &data[i]);
+        assert(!has(m, N + i));
+    }
+    for (uint32_t i = 0; i < N; ++i) {
+        assert(hm_pop<DataTr>(&m, i) == &data[i]);
+        if (i % 65537 == 0) {
+            assert(hm_lookup<DataTr>(&m, N - 1) == &data[N - 1]);
+        }
+    }
+    assert(hm_size(&m) == 0);
+    hm_destroy(&m);
+    delete[] data;
+}
+
+int main() {
+    test_stats();
+    test_big();
+    test_lookup_many();
+    test_scan();
+
+    HMap m;
+    std::set<uint32_t> ref;
+
+    // grow
+    const uint32_t N = 100000;
+    for (uint32_t i = 0; i < N; ++i) {
+        add(m, i);
+        ref.insert(i);
+    }
+    hmap_verify(m, ref, N);
+    size_t big = nbuckets(m);
+    assert(big >= N / 8);
+
+    // 删掉绝大部分，表要逐步缩小，期间查找不受影响
+    for (uint32_t i = 0; i < N; ++i) {
+        if (i % 1000 != 0) {
+            assert(del(m, i));
+            ref.erase(i);
+        }
+        if (i % 9973 == 0) {
+            hmap_verify(m, ref, N);
+        }
+    }
+    // 缩小也是渐进的，多做几次操作把旧表转移完
+    for (uint32_t i = 0; i < N && m.ht2.tab; ++i) {
+        assert(!has(m, N + i));
+    }
+    hmap_verify(m, ref, N);
+    assert(m.ht2.tab == NULL);
+    assert(nbuckets(m) <= 64);
+    assert(nbuckets(m) * 8 >= ref.size());
+
+    // 再长回来
+    for (uint32_t i = N; i < 2 * N; ++i) {
+        add(m, i);
+        ref.insert(i);
+    }
+    hmap_verify(m, ref, 2 * N);
+
+    // 全部删除
+    for (uint32_t val : ref) {
+        assert(del(m, val));
+    }
+    assert(hm_size(&m) == 0);
+    hm_destroy(&m);
+    return 0;
+}
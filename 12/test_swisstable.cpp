@@ -0,0 +1,142 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <set>
+#include "swisstable.cpp"  // lazy
+
+
+#define container_of(ptr, type, member) ({                  \
+    const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
+    (type *)( (char *)__mptr - offsetof(type, member) );})
+
+
+struct Data {
+    HNode node;
+    uint32_t val = 0;
+};
+
+static bool data_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, Data, node)->val == container_of(rhs, Data, node)->val;
+}
+
+// 故意用很差的hash，让探测序列变长、tag大量冲突
+static uint64_t bad_hash(uint32_t val) {
+    return val % 37;
+}
+
+static void add(SMap &m, uint32_t val) {
+    Data *data = new Data();
+    data->val = val;
+    data->node.hcode = bad_hash(val);
+    sm_insert(&m, &data->node);
+}
+
+static bool has(SMap &m, uint32_t val) {
+    Data key;
+    key.val = val;
+    key.node.hcode = bad_hash(val);
+    HNode *node = sm_lookup(&m, &key.node, &data_eq);
+    assert(!node || container_of(node, Data, node)->val == val);
+    return node != NULL;
+}
+
+static bool del(SMap &m, uint32_t val) {
+    Data key;
+    key.val = val;
+    key.node.hcode = bad_hash(val);
+    HNode *node = sm_pop(&m, &key.node, &data_eq);
+    if (!node) {
+        return false;
+    }
+    delete container_of(node, Data, node);
+    return true;
+}
+
+// 检查控制字节和计数是否一致
+static void stab_verify(STab &t) {
+    if (!t.ctrl) {
+        return;
+    }
+    size_t size = 0, tombs = 0;
+    for (size_t i = 0; i <= t.mask; ++i) {
+        if (t.ctrl[i] < 0) {
+            size++;
+            assert(t.ctrl[i] == h_tag(t.slots[i]->hcode));
+        } else if (t.ctrl[i] == k_ctrl_deleted) {
+            tombs++;
+        } else {
+            assert(t.ctrl[i] == k_ctrl_empty);
+        }
+    }
+    assert(size == t.size);
+    assert(tombs == t.tombs);
+}
+
+static void smap_verify(SMap &m, const std::set<uint32_t> &ref, uint32_t range) {
+    stab_verify(m.ht1);
+    stab_verify(m.ht2);
+    assert(sm_size(&m) == ref.size());
+    for (uint32_t val = 0; val < range; ++val) {
+        assert(has(m, val) == (ref.count(val) > 0));
+    }
+}
+
+int main() {
+    SMap m;
+    std::set<uint32_t> ref;
+
+    // some quick tests
+    assert(!has(m, 1));
+    add(m, 1);
+    assert(has(m, 1));
+    assert(!del(m, 2));
+    assert(del(m, 1));
+    assert(!has(m, 1));
+
+    // sequential insertion, 经过多次扩容
+    for (uint32_t i = 0; i < 2000; ++i) {
+        add(m, i);
+        ref.insert(i);
+        if (i % 97 == 0) {
+            smap_verify(m, ref, 2100);
+        }
+    }
+    smap_verify(m, ref, 2100);
+
+    // random insertion/deletion, 留下大量删除标记
+    for (uint32_t i = 0; i < 20000; ++i) {
+        uint32_t val = (uint32_t)rand() % 3000;
+        if (ref.count(val)) {
+            assert(del(m, val));
+            ref.erase(val);
+        } else {
+            add(m, val);
+            ref.insert(val);
+        }
+        if (i % 997 == 0) {
+            smap_verify(m, ref, 3000);
+        }
+    }
+    smap_verify(m, ref, 3000);
+
+    // 删空再插入，同样大小的表要能反复重建
+    for (uint32_t round = 0; round < 20; ++round) {
+        for (uint32_t val : ref) {
+            assert(del(m, val));
+        }
+        ref.clear();
+        smap_verify(m, ref, 3000);
+        for (uint32_t i = 0; i < 500; ++i) {
+            uint32_t val = round * 500 + i;
+            add(m, val);
+            ref.insert(val);
+        }
+        smap_verify(m, ref, 10000);
+    }
+
+    for (uint32_t val : ref) {
+        assert(del(m, val));
+    }
+    sm_destroy(&m);
+    return 0;
+}
@@ -0,0 +1,156 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "zbtree.cpp"  // lazy
+
+
+typedef std::pair<double, std::string> Key;
+
+static ZNode *new_node(const std::string &name, double score) {
+    ZNode *node = (ZNode *)malloc(sizeof(ZNode) + name.size());
+    node->score = score;
+    node->len = name.size();
+    memcpy(node->name, name.data(), name.size());
+    return node;
+}
+
+static Key key_of(ZNode *node) {
+    return Key(node->score, std::string(node->name, node->len));
+}
+
+// 检查计数、父节点里的最小值副本、填充率，返回子树的元素个数
+static uint64_t node_verify(BNode *node, bool root, std::vector<ZNode *> &out) {
+    assert(node->n > 0 && node->n < k_bt_cap);
+    assert(root || node->n >= k_bt_min);
+    if (node->leaf) {
+        for (uint32_t i = 0; i < node->n; ++i) {
+            assert(node->score[i] == node->znode[i]->score);
+            out.push_back(node->znode[i]);
+        }
+        return node->n;
+    }
+    BInner *inner = b_inner(node);
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < node->n; ++i) {
+        BNode *child = inner->child[i];
+        assert(inner->znode[i] == child->znode[0]);
+        assert(inner->score[i] == child->score[0]);
+        uint64_t cnt = node_verify(child, false, out);
+        assert(cnt == inner->cnt[i]);
+        total += cnt;
+    }
+    return total;
+}
+
+static void bt_verify(BTree &t, const std::set<Key> &ref) {
+    assert(t.size == ref.size());
+    if (!t.root) {
+        assert(ref.empty());
+        return;
+    }
+    std::vector<ZNode *> nodes;
+    assert(node_verify(t.root, true, nodes) == ref.size());
+    // 中序就是叶子链表的顺序，也和参照一致
+    auto it = ref.begin();
+    BIter bi = bt_at(&t, 0);
+    for (size_t i = 0; i < nodes.size(); ++i, ++it) {
+        assert(key_of(nodes[i]) == *it);
+        assert(bt_get(bi) == nodes[i]);
+        assert(bt_rank(&t, nodes[i]) == i);
+        assert(bt_get(bt_at(&t, i)) == nodes[i]);
+        bi = bt_next(bi);
+    }
+    assert(bt_get(bi) == NULL);
+    // 反向遍历
+    bi = bt_at(&t, nodes.size() - 1);
+    for (size_t i = nodes.size(); i-- > 0;) {
+        assert(bt_get(bi) == nodes[i]);
+        bi = bt_prev(bi);
+    }
+    assert(bt_get(bi) == NULL);
+}
+
+// seek到任意的(score, name)，再offset
+static void seek_verify(BTree &t, const std::set<Key> &ref) {
+    std::vector<Key> keys(ref.begin(), ref.end());
+    for (int round = 0; round < 200; ++round) {
+        Key k(rand() % 50, "n" + std::to_string(rand() % 600));
+        uint64_t rank = 0;
+        BIter it = bt_seek(&t, k.first, k.second.data(), k.second.size(), &rank);
+        auto lb = ref.lower_bound(k);
+        assert(rank == (uint64_t)std::distance(ref.begin(), lb));
+        assert(lb == ref.end() ? !it.leaf : key_of(bt_get(it)) == *lb);
+        if (!it.leaf) {
+            continue;
+        }
+        int64_t off = rand() % 80 - 40;
+        int64_t target = (int64_t)rank + off;
+        BIter o = bt_offset(&t, it, rank, off);
+        if (target < 0 || target >= (int64_t)keys.size()) {
+            assert(!o.leaf);
+        } else {
+            assert(key_of(bt_get(o)) == keys[target]);
+        }
+    }
+}
+
+int main() {
+    BTree t;
+    std::set<Key> ref;
+    std::vector<ZNode *> live;
+    bt_verify(t, ref);
+
+    // 随机插入和删除，分数重复很多，树要经过多次分裂和合并
+    for (int i = 0; i < 30000; ++i) {
+        bool insert = live.empty() || rand() % 100 < (i < 20000 ? 70 : 25);
+        if (insert) {
+            std::string name = "n" + std::to_string(rand() % 600) + "_" + std::to_string(i);
+            ZNode *node = new_node(name, rand() % 50);
+            bt_insert(&t, node);
+            ref.insert(key_of(node));
+            live.push_back(node);
+        } else {
+            size_t j = rand() % live.size();
+            ZNode *node = live[j];
+            assert(bt_remove(&t, node));
+            assert(!bt_remove(&t, node));
+            ref.erase(key_of(node));
+            live[j] = live.back();
+            live.pop_back();
+            free(node);
+        }
+        if (i % 1499 == 0) {
+            bt_verify(t, ref);
+            seek_verify(t, ref);
+        }
+    }
+    bt_verify(t, ref);
+    seek_verify(t, ref);
+
+    // 全部删掉
+    for (ZNode *node : live) {
+        assert(bt_remove(&t, node));
+        ref.erase(key_of(node));
+        free(node);
+    }
+    live.clear();
+    bt_verify(t, ref);
+    assert(t.root == NULL);
+
+    // 顺序插入再清空
+    for (int i = 0; i < 5000; ++i) {
+        live.push_back(new_node("s" + std::to_string(i), i));
+        bt_insert(&t, live.back());
+    }
+    assert(t.size == 5000 && bt_rank(&t, live[4321]) == 4321);
+    bt_clear(&t);
+    for (ZNode *node : live) {
+        free(node);
+    }
+    return 0;
+}
@@ -0,0 +1,233 @@
+#!/usr/bin/env python3
+# usage: ./server & python3 test_zcmds.py
+# 有序集合命令的端到端测试，和内存里的参考结果对比。
+# 同样的操作分别跑在紧凑编码(少于128个元素)和tree编码上
+
+
+import random
+import socket
+import struct
+
+
+def enc(cmd):
+    body = struct.pack('<I', len(cmd))
+    for a in cmd:
+        a = a if isinstance(a, bytes) else str(a).encode()
+        body += struct.pack('<I', len(a)) + a
+    return struct.pack('<I', len(body)) + body
+
+
+def dec(d, p=0):
+    t = d[p]
+    p += 1
+    if t == 0:      # nil
+        return None, p
+    if t == 1:      # err
+        code, n = struct.unpack_from('<iI', d, p)
+        p += 8
+        return ('ERR', code, d[p:p+n].decode()), p + n
+    if t == 2:      # str
+        n, = struct.unpack_from('<I', d, p)
+        p += 4
+        return d[p:p+n], p + n
+    if t == 3:      # int
+        return struct.unpack_from('<q', d, p)[0], p + 8
+    if t == 4:      # dbl
+        return struct.unpack_from('<d', d, p)[0], p + 8
+    if t == 5:      # arr
+        n, = struct.unpack_from('<I', d, p)
+        p += 4
+        arr = []
+        for _ in range(n):
+            v, p = dec(d, p)
+            arr.append(v)
+        return arr, p
+    raise Exception('bad type %d' % t)
+
+
+class Client:
+    def __init__(self, port=1234):
+        self.sock = socket.create_connection(('127.0.0.1', port))
+        self.buf = b''
+
+    def recv1(self):
+        while True:
+            if len(self.buf) >= 4:
+                n, = struct.unpack_from('<I', self.buf)
+                if len(self.buf) >= 4 + n:
+                    v, p = dec(self.buf[4:4+n])
+                    assert p == n
+                    self.buf = self.buf[4+n:]
+                    return v
+            d = self.sock.recv(1 << 20)
+            if not d:
+                raise EOFError
+            self.buf += d
+
+    def __call__(self, *cmd):
+        self.sock.sendall(enc(cmd))
+        return self.recv1()
+
+    def pipe(self, cmds):
+        self.sock.sendall(b''.join(enc(cmd) for cmd in cmds))
+        return [self.recv1() for _ in cmds]
+
+
+def is_err(r):
+    return isinstance(r, tuple) and r[0] == 'ERR'
+
+
+def flat(pairs):
+    return [x for s, n in pairs for x in (n, s)]
+
+
+# 负数下标和越界的处理和Redis一样
+def clamp(a, b, size):
+    a = a + size if a < 0 else a
+    b = b + size if b < 0 else b
+    a = max(a, 0)
+    b = min(b, size - 1)
+    return (a, b) if a <= b else None
+
+
+def bound(x, ex):
+    return ('(' if ex else '') + str(x)
+
+
+def in_range(s, mn, mne, mx, mxe):
+    return (s > mn if mne else s >= mn) and (s < mx if mxe else s <= mx)
+
+
+def test_errors(c):
+    assert c('zrank', 'nz', 'a') is None
+    assert c('zcount', 'nz', 0, 1) == 0
+    assert c('zrange', 'nz', 0, -1) == []
+    assert c('zrevrangebyscore', 'nz', 1, 0) == []
+    assert c('zremrangebyrank', 'nz', 0, -1) == 0
+    assert c('zremrangebyscore', 'nz', 0, 1) == 0
+    assert c('set', 'str', 'x') is None
+    assert is_err(c('zrank', 'str', 'a'))
+    assert is_err(c('zrange', 'str', 0, 1))
+    assert is_err(c('zremrangebyrank', 'str', 0, 1))
+    c('zadd', 'ze', 1, 'a')
+    assert is_err(c('zcount', 'ze', 'x', 1))
+    assert is_err(c('zrange', 'ze', 'a', 1))
+    assert is_err(c('zrevrangebyscore', 'ze', 1, 0, 'limt', 0, 1))
+    c('del', 'str')
+    c('del', 'ze')
+
+
+def test_rank(c):
+    for i, n in enumerate('abcde'):
+        c('zadd', 'zr', i, n)
+    assert [c('zrank', 'zr', n) for n in 'abcde'] == [0, 1, 2, 3, 4]
+    assert [c('zrevrank', 'zr', n) for n in 'abcde'] == [4, 3, 2, 1, 0]
+    assert c('zrank', 'zr', 'x') is None
+    assert c('zcount', 'zr', 1, 3) == 3
+    assert c('zcount', 'zr', '(1', 3) == 2
+    assert c('zcount', 'zr', '(1', '(3') == 1
+    assert c('zcount', 'zr', '-inf', '+inf') == 5
+    assert c('zcount', 'zr', 3, 1) == 0
+    c('del', 'zr')
+
+
+# 随机生成一个集合，再用各种下标和分数区间去查
+def check_range(c, key, nmembers, nscores):
+    ref = []
+    cmds = []
+    for i in range(nmembers):
+        s = random.randint(0, nscores)
+        cmds.append(('zadd', key, s, 'm%d' % i))
+        ref.append((float(s), b'm%d' % i))
+    c.pipe(cmds)
+    ref.sort()
+    rev = ref[::-1]
+    size = len(ref)
+    for n in random.sample(ref, min(size, 50)):
+        assert c('zrank', key, n[1]) == ref.index(n)
+        assert c('zrevrank', key, n[1]) == rev.index(n)
+    for _ in range(300):
+        a = random.randint(-size - 5, size + 5)
+        b = random.randint(-size - 5, size + 5)
+        r = clamp(a, b, size)
+        assert c('zrange', key, a, b) == (flat(ref[r[0]:r[1] + 1]) if r else [])
+        assert c('zrevrange', key, a, b) == (flat(rev[r[0]:r[1] + 1]) if r else [])
+
+        mn, mx = random.randint(-2, nscores + 2), random.randint(-2, nscores + 2)
+        mne, mxe = random.random() < .5, random.random() < .5
+        sel = [p for p in rev if in_range(p[0], mn, mne, mx, mxe)]
+        args = (bound(mx, mxe), bound(mn, mne))
+        assert c('zcount', key, bound(mn, mne), bound(mx, mxe)) == len(sel)
+        assert c('zrevrangebyscore', key, *args) == flat(sel)
+        off, cnt = random.randint(-1, 30), random.randint(-1, 30)
+        e = [] if off < 0 else sel[off:] if cnt < 0 else sel[off:off + cnt]
+        assert c('zrevrangebyscore', key, *args, 'LIMIT', off, cnt) == flat(e)
+    c('del', key)
+
+
+# 随机删掉一段排名或分数，剩下的和参考结果一样
+def check_remrange(c, key, nmembers, nscores):
+    ref = {}
+    for r in range(30):
+        cmds = []
+        while len(ref) < nmembers:
+            n, s = b'm%d' % random.randint(0, 10**6), random.randint(0, nscores)
+            cmds.append(('zadd', key, s, n))
+            ref[n] = float(s)
+        c.pipe(cmds)
+        srt = sorted((s, n) for n, s in ref.items())
+        if r % 2:
+            a = random.randint(-nmembers - 5, nmembers + 5)
+            b = random.randint(-nmembers - 5, nmembers + 5)
+            rg = clamp(a, b, len(srt))
+            keep = srt[:rg[0]] + srt[rg[1] + 1:] if rg else srt
+            got = c('zremrangebyrank', key, a, b)
+        else:
+            mn, mx = random.randint(-5, nscores + 5), random.randint(-5, nscores + 5)
+            mne, mxe = random.random() < .5, random.random() < .5
+            keep = [p for p in srt if not in_range(p[0], mn, mne, mx, mxe)]
+            got = c('zremrangebyscore', key, bound(mn, mne), bound(mx, mxe))
+        assert got == len(srt) - len(keep), (got, len(srt), len(keep))
+        ref = {n: s for s, n in keep}
+        assert c('zrange', key, 0, -1) == flat(keep)
+        for s, n in keep[:20]:
+            assert c('zscore', key, n) == s
+        for s, n in (srt[i] for i in range(0, len(srt), 7)):
+            assert c('zscore', key, n) == (s if n in ref else None)
+    c('del', key)
+
+
+# 紧凑编码因为元素个数或名字长度转成tree以后，内容不变
+def test_convert(c):
+    names = [b'n%03d' % i for i in range(128)]
+    c.pipe([('zadd', 'zc', i % 10, n) for i, n in enumerate(names)])
+    ref = sorted((float(i % 10), n) for i, n in enumerate(names))
+    assert c('zrange', 'zc', 0, -1) == flat(ref)
+    assert c('zadd', 'zc', 3.5, 'over') == 1
+    ref = sorted(ref + [(3.5, b'over')])
+    assert c('zrange', 'zc', 0, -1) == flat(ref)
+    assert c('zrank', 'zc', 'over') == ref.index((3.5, b'over'))
+    c('del', 'zc')
+
+    assert c('zadd', 'zl', 1, 'a') == 1
+    assert c('zadd', 'zl', 2, 'x' * 64) == 1
+    assert c('zadd', 'zl', 3, 'y' * 65) == 1
+    assert c('zrange', 'zl', 0, -1) == [b'a', 1.0, b'x' * 64, 2.0, b'y' * 65, 3.0]
+    assert c('zrem', 'zl', 'x' * 64) == 1
+    assert c('zrevrange', 'zl', 0, -1) == [b'y' * 65, 3.0, b'a', 1.0]
+    c('del', 'zl')
+
+
+def main():
+    c = Client()
+    test_errors(c)
+    test_rank(c)
+    test_convert(c)
+    for nmembers in (5, 100, 2000):
+        check_range(c, 'zq%d' % nmembers, nmembers, 30)
+        check_remrange(c, 'zd%d' % nmembers, nmembers, 200)
+    print('zset commands ok')
+
+
+if __name__ == '__main__':
+    main()
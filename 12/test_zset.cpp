@@ -0,0 +1,270 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <iterator>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "hashtable.cpp"  // lazy
+#include "zset.cpp"       // lazy
+
+
+typedef std::set<std::pair<double, std::string>> Ref;
+
+static bool has(ZSet &z, const std::string &name) {
+    double score = 0;
+    return zset_score(&z, name.data(), name.size(), &score);
+}
+
+static void add(ZSet &z, Ref &ref, const std::string &name, double score) {
+    double old = 0;
+    bool found = zset_score(&z, name.data(), name.size(), &old);
+    if (found) {
+        ref.erase({old, name});
+    }
+    assert(zset_add(&z, name.data(), name.size(), score) == !found);
+    ref.insert({score, name});
+}
+
+static void del(ZSet &z, Ref &ref, const std::string &name) {
+    double score = 0;
+    assert(zset_score(&z, name.data(), name.size(), &score));
+    assert(zset_rem(&z, name.data(), name.size()));
+    assert(!zset_rem(&z, name.data(), name.size()));
+    ref.erase({score, name});
+}
+
+static bool zit_eq(ZIter it, const std::pair<double, std::string> &p) {
+    size_t len = 0;
+    const char *name = zit_name(it, &len);
+    return it.ok && zit_score(it) == p.first && std::string(name, len) == p.second;
+}
+
+// 每个元素的rank都和有序集合里的位置一致，前后遍历也一致
+static void rank_verify(ZSet &z, const Ref &ref) {
+    assert(zset_size(&z) == ref.size());
+    uint64_t i = 0;
+    ZIter it = zset_at(&z, 0);
+    for (auto &p : ref) {
+        double score = 0;
+        uint64_t rank = 0;
+        assert(zset_score(&z, p.second.data(), p.second.size(), &score));
+        assert(score == p.first);
+        assert(zit_eq(zset_at(&z, i), p));
+        assert(zit_eq(it, p));
+        assert(zset_rank(&z, p.second.data(), p.second.size(), &rank));
+        assert(rank == i++);
+        it = zit_offset(it, +1);
+    }
+    assert(!it.ok);
+    assert(!zset_at(&z, i).ok);
+    if (ref.empty()) {
+        return;
+    }
+    it = zset_at(&z, ref.size() - 1);
+    for (auto p = ref.rbegin(); p != ref.rend(); ++p) {
+        assert(zit_eq(it, *p));
+        it = zit_offset(it, -1);
+    }
+    assert(!it.ok);
+}
+
+// 从任意(score, name)开始往前后offset，和参照一致
+static void query_verify(ZSet &z, const Ref &ref) {
+    std::vector<std::pair<double, std::string>> keys(ref.begin(), ref.end());
+    for (int i = 0; i < 50; ++i) {
+        std::pair<double, std::string> k(rand() % 40, "n" + std::to_string(rand() % 100));
+        int64_t off = rand() % 20 - 10;
+        ZIter it = zset_query(&z, k.first, k.second.data(), k.second.size(), off);
+        int64_t pos = std::distance(ref.begin(), ref.lower_bound(k));
+        if (pos == (int64_t)keys.size() || pos + off < 0 || pos + off >= (int64_t)keys.size()) {
+            assert(!it.ok);
+        } else {
+            assert(zit_eq(it, keys[pos + off]));
+        }
+    }
+}
+
+static uint64_t count_ref(const Ref &ref, double min, bool minex, double max, bool maxex) {
+    uint64_t n = 0;
+    for (auto &p : ref) {
+        bool lo = minex ? p.first > min : p.first >= min;
+        bool hi = maxex ? p.first < max : p.first <= max;
+        n += lo && hi;
+    }
+    return n;
+}
+
+static void count_verify(ZSet &z, const Ref &ref) {
+    for (int i = 0; i < 50; ++i) {
+        double min = rand() % 40, max = rand() % 40;
+        bool minex = rand() % 2, maxex = rand() % 2;
+        assert(zset_count(&z, min, minex, max, maxex)
+            == count_ref(ref, min, minex, max, maxex));
+        assert(zset_count_below(&z, max, !maxex)
+            == count_ref(ref, -INFINITY, false, max, maxex));
+    }
+    assert(zset_count(&z, -INFINITY, false, INFINITY, false) == ref.size());
+}
+
+// 高度、计数、父指针和平衡都要对，返回节点数
+static uint32_t avl_verify(AVLNode *parent, AVLNode *node) {
+    if (!node) {
+        return 0;
+    }
+    assert(node->parent == parent);
+    uint32_t l = avl_verify(node, node->left);
+    uint32_t r = avl_verify(node, node->right);
+    assert(node->cnt == 1 + l + r);
+    uint32_t dl = avl_depth(node->left), dr = avl_depth(node->right);
+    assert(node->depth == 1 + max(dl, dr));
+    assert(dl <= dr + 1 && dr <= dl + 1);
+    if (node->left) {
+        assert(zless(node->left, node));
+    }
+    if (node->right) {
+        assert(zless(node, node->right));
+    }
+    return node->cnt;
+}
+
+// 在各种位置切开再接回去，树始终合法，顺序不变
+static void test_split_join(ZSet &z, const Ref &ref) {
+    uint64_t n = zset_size(&z);
+    for (uint64_t k = 0; k <= n; k += 1 + k / 3) {
+        AVLNode *l = NULL, *r = NULL;
+        avl_split(z.big->tree, k, &l, &r);
+        assert(avl_verify(NULL, l) == k);
+        assert(avl_verify(NULL, r) == n - k);
+        z.big->tree = avl_join2(l, r);
+        assert(avl_verify(NULL, z.big->tree) == n);
+        rank_verify(z, ref);
+    }
+}
+
+// 删除一段排名，和逐个删除的结果一样，摘下来的子树分批释放
+static void rem_range(ZSet &z, Ref &ref, uint64_t start, uint64_t stop) {
+    auto first = ref.begin(), last = ref.begin();
+    std::advance(first, start);
+    std::advance(last, stop);
+    ref.erase(first, last);
+    AVLNode *garbage = zset_rem_range(&z, start, stop);
+    if (!z.big) {
+        assert(!garbage && z.pack_n == ref.size());
+        rank_verify(z, ref);
+        return;
+    }
+    assert(avl_cnt(garbage) == stop - start);
+    size_t freed = 0;
+    while (garbage) {
+        freed += zset_free_some(&garbage, 7);
+    }
+    assert(freed == stop - start);
+    assert(avl_verify(NULL, z.big->tree) == ref.size());
+    assert(hm_size(&z.big->hmap) == ref.size());
+    rank_verify(z, ref);
+}
+
+// 紧凑编码下的各种操作，再分别因为元素个数和名字长度转成tree
+static void test_pack(bool by_name) {
+    assert(sizeof(ZSet) <= 24);     // 小集合只有pack，tree和hmap等转换时再分配
+    ZSet z;
+    Ref ref;
+    for (int i = 0; i < 3000; ++i) {
+        std::string name = "n" + std::to_string(rand() % 100);
+        int op = rand() % 10;
+        if (op < 6) {
+            add(z, ref, name, rand() % 40);
+        } else if (op < 8 && has(z, name)) {
+            del(z, ref, name);
+        } else if (op == 8 && !ref.empty()) {
+            uint64_t a = rand() % ref.size(), len = rand() % 5;
+            uint64_t stop = a + len < ref.size() ? a + len : ref.size();
+            rem_range(z, ref, a, stop);
+        }
+        assert(!z.big);
+        assert(z.pack_n == ref.size() && (z.pack_n == 0) == (z.pack == NULL));
+        if (i % 37 == 0) {
+            rank_verify(z, ref);
+            count_verify(z, ref);
+            query_verify(z, ref);
+        }
+    }
+    if (by_name) {
+        add(z, ref, std::string(k_pack_max_name, 'x'), 1);
+        assert(!z.big);
+        add(z, ref, std::string(k_pack_max_name + 1, 'x'), 1);
+    } else {
+        for (int i = 0; zset_size(&z) < k_pack_max_n; ++i) {
+            add(z, ref, "m" + std::to_string(i), rand() % 40);
+        }
+        assert(!z.big);
+        add(z, ref, "last", 0.5);
+    }
+    assert(z.big && !z.pack);
+    assert(avl_verify(NULL, z.big->tree) == ref.size());
+    rank_verify(z, ref);
+    count_verify(z, ref);
+    query_verify(z, ref);
+    zset_dispose(&z);
+}
+
+static void test_rem_range() {
+    ZSet z;
+    Ref ref;
+    for (int i = 0; i < 3000; ++i) {
+        add(z, ref, "r" + std::to_string(i), rand() % 100);
+    }
+    test_split_join(z, ref);
+    // 删掉大部分，hmap用剩下的重建
+    rem_range(z, ref, 5, ref.size() - 500);
+    while (ref.size() > 10) {
+        uint64_t a = rand() % ref.size(), b = rand() % ref.size();
+        uint64_t len = (a > b ? a - b : b - a) % 300;
+        uint64_t start = a < b ? a : b;
+        rem_range(z, ref, start, start + len);
+        // 删掉的名字可以重新加回来
+        add(z, ref, "again" + std::to_string(ref.size()), rand() % 100);
+    }
+    rem_range(z, ref, 0, ref.size());
+    assert(z.big->tree == NULL);
+    zset_dispose(&z);
+}
+
+int main() {
+    ZSet z;
+    Ref ref;
+    assert(zset_size(&z) == 0);
+    assert(zset_count(&z, 0, false, 1, false) == 0);
+
+    // 分数重复很多，按名字排序的部分也要对
+    for (int i = 0; i < 2000; ++i) {
+        add(z, ref, "n" + std::to_string(rand() % 1500), rand() % 32);
+        if (i % 97 == 0 || i < 130) {
+            rank_verify(z, ref);
+            count_verify(z, ref);
+            query_verify(z, ref);
+        }
+    }
+    rank_verify(z, ref);
+    count_verify(z, ref);
+
+    // 删除一部分，树的形状和计数都在变
+    for (int i = 0; i < 1500; i += 3) {
+        std::string name = "n" + std::to_string(i);
+        if (has(z, name)) {
+            del(z, ref, name);
+        }
+    }
+    rank_verify(z, ref);
+    count_verify(z, ref);
+
+    zset_dispose(&z);
+
+    test_rem_range();
+    test_pack(false);
+    test_pack(true);
+    return 0;
+}
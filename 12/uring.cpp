@@ -0,0 +1,203 @@
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+// proj
+#include "uring.h"
+
+
+static int sys_setup(uint32_t entries, io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(
+    int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags,
+    const void *arg, size_t argsz)
+{
+    return (int)syscall(
+        __NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz
+    );
+}
+
+static int sys_register(int fd, uint32_t opcode, const void *arg, uint32_t n) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, n);
+}
+
+int uring_init(URing *ring, uint32_t entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // CQ比SQ大，multishot请求一次提交会产生多个完成事件
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    int fd = sys_setup(entries, &p);
+    if (fd < 0) {
+        return -1;
+    }
+    // 需要IORING_ENTER_EXT_ARG来实现带超时的等待
+    if (!(p.features & IORING_FEAT_EXT_ARG)
+        || !(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring->fd = fd;
+    ring->features = p.features;
+    ring->sq_sz = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    ring->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (ring->cq_sz > ring->sq_sz) {
+        ring->sq_sz = ring->cq_sz;
+    }
+    ring->cq_sz = ring->sq_sz;  // SINGLE_MMAP: SQ和CQ共用一次映射
+    ring->sq_ptr = mmap(
+        NULL, ring->sq_sz, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING
+    );
+    if (ring->sq_ptr == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    ring->cq_ptr = ring->sq_ptr;
+    ring->sqes_sz = p.sq_entries * sizeof(io_uring_sqe);
+    ring->sqes = (io_uring_sqe *)mmap(
+        NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES
+    );
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->sq_ptr, ring->sq_sz);
+        close(fd);
+        return -1;
+    }
+
+    uint8_t *sq = (uint8_t *)ring->sq_ptr;
+    ring->sq_head = (uint32_t *)(sq + p.sq_off.head);
+    ring->sq_tail = (uint32_t *)(sq + p.sq_off.tail);
+    ring->sq_mask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_array = (uint32_t *)(sq + p.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+
+    uint8_t *cq = (uint8_t *)ring->cq_ptr;
+    ring->cq_head = (uint32_t *)(cq + p.cq_off.head);
+    ring->cq_tail = (uint32_t *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+void uring_exit(URing *ring) {
+    munmap(ring->sqes, ring->sqes_sz);
+    munmap(ring->sq_ptr, ring->sq_sz);
+    close(ring->fd);
+    *ring = URing{};
+}
+
+io_uring_sqe *uring_get_sqe(URing *ring) {
+    uint32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        return NULL;    // full
+    }
+    uint32_t idx = ring->sqe_tail & ring->sq_mask;
+    io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sqe_tail++;
+    return sqe;
+}
+
+int uring_submit_and_wait(URing *ring, uint32_t wait_nr, int timeout_ms) {
+    uint32_t tail = *ring->sq_tail;
+    uint32_t to_submit = ring->sqe_tail - tail;
+    // 发布新的tail，内核通过acquire读取
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    uint32_t flags = 0;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    __kernel_timespec ts = {};
+    if (wait_nr) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    if (wait_nr && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    flags |= IORING_ENTER_EXT_ARG;
+    int rv = sys_enter(ring->fd, to_submit, wait_nr, flags, &arg, sizeof(arg));
+    if (rv < 0 && (errno == ETIME || errno == EINTR)) {
+        return 0;   // timed out, not an error
+    }
+    return rv;
+}
+
+io_uring_cqe *uring_peek_cqe(URing *ring) {
+    uint32_t head = *ring->cq_head;
+    uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(URing *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_setup_buf_ring(
+    URing *ring, UBufRing *br, uint16_t bgid, uint16_t nbufs, uint32_t buf_size)
+{
+    assert((nbufs > 0) && ((nbufs - 1) & nbufs) == 0);  // 2的幂
+    size_t ring_sz = nbufs * sizeof(io_uring_buf);
+    void *ptr = mmap(
+        NULL, ring_sz, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+    );
+    if (ptr == MAP_FAILED) {
+        return -1;
+    }
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ptr;
+    reg.ring_entries = nbufs;
+    reg.bgid = bgid;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(ptr, ring_sz);
+        return -1;
+    }
+    br->br = (io_uring_buf_ring *)ptr;
+    br->bufs = (uint8_t *)mmap(
+        NULL, (size_t)nbufs * buf_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+    );
+    if (br->bufs == MAP_FAILED) {
+        return -1;
+    }
+    br->buf_size = buf_size;
+    br->nbufs = nbufs;
+    br->bgid = bgid;
+    br->br->tail = 0;
+    for (uint16_t bid = 0; bid < nbufs; ++bid) {
+        uring_buf_recycle(br, bid);
+    }
+    return 0;
+}
+
+uint8_t *uring_buf(UBufRing *br, uint16_t bid) {
+    return br->bufs + (size_t)bid * br->buf_size;
+}
+
+// 把用完的缓冲区还给内核
+void uring_buf_recycle(UBufRing *br, uint16_t bid) {
+    uint16_t tail = br->br->tail;
+    // note: 不能用br->bufs, __DECLARE_FLEX_ARRAY在C++中会引入一个非空的占位成员
+    io_uring_buf *slots = (io_uring_buf *)br->br;
+    io_uring_buf *buf = &slots[tail & (br->nbufs - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buf(br, bid);
+    buf->len = br->buf_size;
+    buf->bid = bid;
+    __atomic_store_n(&br->br->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
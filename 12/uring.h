@@ -0,0 +1,53 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// 直接基于io_uring系统调用的最小封装，不依赖liburing
+struct URing{
+    int fd = -1;
+    uint32_t features = 0;
+    // submission queue
+    uint32_t *sq_head = NULL;
+    uint32_t *sq_tail = NULL;
+    uint32_t *sq_array = NULL;
+    uint32_t sq_mask = 0;
+    uint32_t sq_entries = 0;
+    uint32_t sqe_tail = 0;      // 本地已填好但尚未发布的tail
+    io_uring_sqe *sqes = NULL;
+    // completion queue
+    uint32_t *cq_head = NULL;
+    uint32_t *cq_tail = NULL;
+    uint32_t cq_mask = 0;
+    io_uring_cqe *cqes = NULL;
+    // mmap
+    void *sq_ptr = NULL;
+    size_t sq_sz = 0;
+    void *cq_ptr = NULL;
+    size_t cq_sz = 0;
+    size_t sqes_sz = 0;
+};
+
+// provided buffer ring, 内核在recv完成时从中挑选缓冲区
+struct UBufRing{
+    io_uring_buf_ring *br = NULL;
+    uint8_t *bufs = NULL;
+    uint32_t buf_size = 0;
+    uint16_t nbufs = 0;
+    uint16_t bgid = 0;
+};
+
+int uring_init(URing *ring, uint32_t entries);
+void uring_exit(URing *ring);
+// 返回NULL表示SQ已满，需要先提交
+io_uring_sqe *uring_get_sqe(URing *ring);
+// 提交所有SQE并等待至少wait_nr个完成事件，timeout_ms < 0 表示不超时
+int uring_submit_and_wait(URing *ring, uint32_t wait_nr, int timeout_ms);
+io_uring_cqe *uring_peek_cqe(URing *ring);
+void uring_cqe_seen(URing *ring);
+
+int uring_setup_buf_ring(
+    URing *ring, UBufRing *br, uint16_t bgid, uint16_t nbufs, uint32_t buf_size
+);
+uint8_t *uring_buf(UBufRing *br, uint16_t bid);
+void uring_buf_recycle(UBufRing *br, uint16_t bid);
@@ -0,0 +1,347 @@
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+// proj
+#include "zbtree.h"
+
+
+// 少于这么多就和兄弟节点合并或者借一些过来
+const uint32_t k_bt_min = k_bt_cap / 4;
+
+// 元素(score, zn)和(score, name)比较，名字只在score相同时才看
+static int b_cmp(double s, ZNode *zn, double score, const char *name, size_t len) {
+    if (s != score) {
+        return s < score ? -1 : 1;
+    }
+    size_t n = zn->len < len ? zn->len : len;
+    int rv = memcmp(zn->name, name, n);
+    if (rv != 0) {
+        return rv;
+    }
+    return zn->len < len ? -1 : zn->len > len ? 1 : 0;
+}
+
+// 叶子里第一个不小于key的位置
+static uint32_t b_lower(BNode *node, double score, const char *name, size_t len) {
+    uint32_t i = 0;
+    while (i < node->n && b_cmp(node->score[i], node->znode[i], score, name, len) < 0) {
+        i++;
+    }
+    return i;
+}
+
+// 内部节点里key所在的子树：最小元素不大于key的最后一个，都大于时是第一个
+static uint32_t b_child(BNode *node, double score, const char *name, size_t len) {
+    uint32_t i = 1;
+    while (i < node->n && b_cmp(node->score[i], node->znode[i], score, name, len) <= 0) {
+        i++;
+    }
+    return i - 1;
+}
+
+static BInner *b_inner(BNode *node) {
+    assert(!node->leaf);
+    return (BInner *)node;
+}
+
+static BLeaf *b_leaf(BNode *node) {
+    assert(node->leaf);
+    return (BLeaf *)node;
+}
+
+static uint64_t b_count(BNode *node) {
+    if (node->leaf) {
+        return node->n;
+    }
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < node->n; ++i) {
+        n += b_inner(node)->cnt[i];
+    }
+    return n;
+}
+
+// 从src[si]开始复制k个到dst[di]，两个节点可以是同一个
+static void b_copy(BNode *dst, uint32_t di, BNode *src, uint32_t si, uint32_t k) {
+    memmove(&dst->score[di], &src->score[si], k * sizeof(double));
+    memmove(&dst->znode[di], &src->znode[si], k * sizeof(ZNode *));
+    if (!dst->leaf) {
+        memmove(&b_inner(dst)->cnt[di], &b_inner(src)->cnt[si], k * sizeof(uint32_t));
+        memmove(&b_inner(dst)->child[di], &b_inner(src)->child[si], k * sizeof(BNode *));
+    }
+}
+
+// 子树最小的元素变了，更新父节点里的副本
+static void b_refresh(BInner *parent, uint32_t i) {
+    BNode *child = parent->child[i];
+    parent->score[i] = child->score[0];
+    parent->znode[i] = child->znode[0];
+}
+
+static BNode *b_new(bool leaf) {
+    BNode *node = leaf ? (BNode *)new BLeaf() : (BNode *)new BInner();
+    node->leaf = leaf;
+    return node;
+}
+
+static void b_del(BNode *node) {
+    if (node->leaf) {
+        delete b_leaf(node);
+    } else {
+        delete b_inner(node);
+    }
+}
+
+// 后一半搬到新节点，叶子要接到链表里
+static BNode *b_split(BNode *node) {
+    BNode *right = b_new(node->leaf);
+    uint32_t half = node->n / 2;
+    b_copy(right, 0, node, half, node->n - half);
+    right->n = node->n - half;
+    node->n = half;
+    if (node->leaf) {
+        BLeaf *l = b_leaf(node), *r = b_leaf(right);
+        r->next = l->next;
+        r->prev = l;
+        if (l->next) {
+            l->next->prev = r;
+        }
+        l->next = r;
+    }
+    return right;
+}
+
+// 插入到node为根的子树里，node满了就分裂，返回分出来的右半边
+static BNode *b_insert(BNode *node, ZNode *zn) {
+    if (node->leaf) {
+        uint32_t pos = b_lower(node, zn->score, zn->name, zn->len);
+        b_copy(node, pos + 1, node, pos, node->n - pos);
+        node->score[pos] = zn->score;
+        node->znode[pos] = zn;
+        node->n++;
+    } else {
+        BInner *inner = b_inner(node);
+        uint32_t i = b_child(node, zn->score, zn->name, zn->len);
+        BNode *right = b_insert(inner->child[i], zn);
+        inner->cnt[i]++;
+        b_refresh(inner, i);
+        if (right) {
+            uint32_t rcnt = (uint32_t)b_count(right);
+            b_copy(node, i + 2, node, i + 1, node->n - i - 1);
+            inner->child[i + 1] = right;
+            inner->cnt[i + 1] = rcnt;
+            inner->cnt[i] -= rcnt;
+            b_refresh(inner, i + 1);
+            node->n++;
+        }
+    }
+    return node->n == k_bt_cap ? b_split(node) : NULL;
+}
+
+void bt_insert(BTree *tree, ZNode *znode) {
+    if (!tree->root) {
+        tree->root = b_new(true);
+    }
+    BNode *right = b_insert(tree->root, znode);
+    if (right) {
+        // 根分裂了，树长高一层
+        BInner *root = b_inner(b_new(false));
+        root->child[0] = tree->root;
+        root->child[1] = right;
+        root->cnt[0] = (uint32_t)b_count(tree->root);
+        root->cnt[1] = (uint32_t)b_count(right);
+        root->n = 2;
+        b_refresh(root, 0);
+        b_refresh(root, 1);
+        tree->root = root;
+    }
+    tree->size++;
+}
+
+// 第i个子树太小了，和相邻的一个合并，合并不下就两边平分
+static void b_fix_underflow(BInner *parent, uint32_t i) {
+    uint32_t a = i + 1 < parent->n ? i : i - 1;
+    BNode *l = parent->child[a], *r = parent->child[a + 1];
+    if (l->n + r->n < k_bt_cap) {
+        b_copy(l, l->n, r, 0, r->n);
+        l->n += r->n;
+        if (l->leaf) {
+            BLeaf *ll = b_leaf(l), *rl = b_leaf(r);
+            ll->next = rl->next;
+            if (rl->next) {
+                rl->next->prev = ll;
+            }
+        }
+        parent->cnt[a] += parent->cnt[a + 1];
+        b_refresh(parent, a);
+        b_del(r);
+        b_copy(parent, a + 1, parent, a + 2, parent->n - a - 2);
+        parent->n--;
+        return;
+    }
+    uint32_t total = l->n + r->n;
+    uint32_t want = total / 2;
+    if (l->n > want) {
+        // 左边的尾部挪到右边的头部
+        uint32_t k = l->n - want;
+        b_copy(r, k, r, 0, r->n);
+        b_copy(r, 0, l, want, k);
+        l->n -= k;
+        r->n += k;
+    } else {
+        uint32_t k = want - l->n;
+        b_copy(l, l->n, r, 0, k);
+        b_copy(r, 0, r, k, r->n - k);
+        l->n += k;
+        r->n -= k;
+    }
+    uint32_t sum = parent->cnt[a] + parent->cnt[a + 1];
+    parent->cnt[a] = (uint32_t)b_count(l);
+    parent->cnt[a + 1] = sum - parent->cnt[a];
+    b_refresh(parent, a);
+    b_refresh(parent, a + 1);
+}
+
+static bool b_remove(BNode *node, ZNode *zn) {
+    if (node->leaf) {
+        uint32_t pos = b_lower(node, zn->score, zn->name, zn->len);
+        if (pos == node->n || node->znode[pos] != zn) {
+            return false;
+        }
+        b_copy(node, pos, node, pos + 1, node->n - pos - 1);
+        node->n--;
+        return true;
+    }
+    BInner *inner = b_inner(node);
+    uint32_t i = b_child(node, zn->score, zn->name, zn->len);
+    BNode *child = inner->child[i];
+    if (!b_remove(child, zn)) {
+        return false;
+    }
+    inner->cnt[i]--;
+    if (child->n > 0) {
+        b_refresh(inner, i);
+    }
+    if (child->n < k_bt_min && node->n > 1) {
+        b_fix_underflow(inner, i);
+    }
+    return true;
+}
+
+bool bt_remove(BTree *tree, ZNode *znode) {
+    if (!tree->root || !b_remove(tree->root, znode)) {
+        return false;
+    }
+    tree->size--;
+    BNode *root = tree->root;
+    if (!root->leaf && root->n == 1) {
+        // 根只剩一个子树，树变矮一层
+        tree->root = b_inner(root)->child[0];
+        b_del(root);
+    } else if (root->leaf && root->n == 0) {
+        b_del(root);
+        tree->root = NULL;
+    }
+    return true;
+}
+
+// 第一个不小于(score, name)的元素，*rank是排在它前面的元素个数
+BIter bt_seek(BTree *tree, double score, const char *name, size_t len, uint64_t *rank) {
+    uint64_t r = 0;
+    BNode *node = tree->root;
+    if (!node) {
+        *rank = 0;
+        return BIter{};
+    }
+    while (!node->leaf) {
+        BInner *inner = b_inner(node);
+        uint32_t i = b_child(node, score, name, len);
+        for (uint32_t j = 0; j < i; ++j) {
+            r += inner->cnt[j];
+        }
+        node = inner->child[i];
+    }
+    uint32_t pos = b_lower(node, score, name, len);
+    *rank = r + pos;
+    BIter it;
+    it.leaf = b_leaf(node);
+    it.i = pos;
+    if (pos == node->n) {
+        // 比这个叶子里的都大，就是下一个叶子的第一个
+        it.leaf = it.leaf->next;
+        it.i = 0;
+    }
+    return it;
+}
+
+BIter bt_at(BTree *tree, uint64_t rank) {
+    if (rank >= tree->size) {
+        return BIter{};
+    }
+    BNode *node = tree->root;
+    while (!node->leaf) {
+        BInner *inner = b_inner(node);
+        uint32_t i = 0;
+        while (rank >= inner->cnt[i]) {
+            rank -= inner->cnt[i];
+            i++;
+        }
+        node = inner->child[i];
+    }
+    BIter it;
+    it.leaf = b_leaf(node);
+    it.i = (uint32_t)rank;
+    return it;
+}
+
+uint64_t bt_rank(BTree *tree, ZNode *znode) {
+    uint64_t rank = 0;
+    BIter it = bt_seek(tree, znode->score, znode->name, znode->len, &rank);
+    assert(bt_get(it) == znode);
+    return rank;
+}
+
+BIter bt_next(BIter it) {
+    if (++it.i == it.leaf->n) {
+        it.leaf = it.leaf->next;
+        it.i = 0;
+    }
+    return it;
+}
+
+BIter bt_prev(BIter it) {
+    if (it.i == 0) {
+        it.leaf = it.leaf->prev;
+        it.i = it.leaf ? it.leaf->n - 1 : 0;
+    } else {
+        it.i--;
+    }
+    return it;
+}
+
+// 和avl_offset一样，rank是it的排名。落在同一个叶子里就不用从根往下走
+BIter bt_offset(BTree *tree, BIter it, uint64_t rank, int64_t offset) {
+    int64_t i = (int64_t)it.i + offset;
+    if (it.leaf && i >= 0 && i < (int64_t)it.leaf->n) {
+        it.i = (uint32_t)i;
+        return it;
+    }
+    int64_t target = (int64_t)rank + offset;
+    return target < 0 ? BIter{} : bt_at(tree, (uint64_t)target);
+}
+
+static void b_dispose(BNode *node) {
+    if (!node->leaf) {
+        for (uint32_t i = 0; i < node->n; ++i) {
+            b_dispose(b_inner(node)->child[i]);
+        }
+    }
+    b_del(node);
+}
+
+// 只释放树本身，ZNode归调用者
+void bt_clear(BTree *tree) {
+    if (tree->root) {
+        b_dispose(tree->root);
+    }
+    *tree = BTree{};
+}
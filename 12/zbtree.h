@@ -0,0 +1,53 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "zset.h"
+
+// 按(score, name)排序的B+树，可以替代ZSet里的AVL树。
+// 叶子里连续存放(score, ZNode *)，比较时一般只看score，不用访问ZNode；
+// 叶子之间用链表串起来，范围扫描是顺序访问内存。
+// 内部节点记录每个子树的元素个数，排名和按排名定位都是O(log n)
+const uint32_t k_bt_cap = 32;
+
+struct BNode {
+    uint32_t n = 0;     // 叶子里是元素个数，内部节点里是子树个数
+    bool leaf = true;
+    // 内部节点里存的是对应子树最小的元素
+    double score[k_bt_cap];
+    ZNode *znode[k_bt_cap];
+};
+
+struct BLeaf : BNode {
+    BLeaf *prev = NULL;
+    BLeaf *next = NULL;
+};
+
+struct BInner : BNode {
+    uint32_t cnt[k_bt_cap];
+    BNode *child[k_bt_cap];
+};
+
+struct BTree {
+    BNode *root = NULL;
+    uint64_t size = 0;
+};
+
+// 指向叶子里的一个元素，leaf为NULL表示越界
+struct BIter {
+    BLeaf *leaf = NULL;
+    uint32_t i = 0;
+};
+
+inline ZNode *bt_get(BIter it) {
+    return it.leaf ? it.leaf->znode[it.i] : NULL;
+}
+
+void bt_insert(BTree *tree, ZNode *znode);
+bool bt_remove(BTree *tree, ZNode *znode);
+BIter bt_seek(BTree *tree, double score, const char *name, size_t len, uint64_t *rank);
+BIter bt_at(BTree *tree, uint64_t rank);
+uint64_t bt_rank(BTree *tree, ZNode *znode);
+BIter bt_next(BIter it);
+BIter bt_prev(BIter it);
+BIter bt_offset(BTree *tree, BIter it, uint64_t rank, int64_t offset);
+void bt_clear(BTree *tree);
@@ -44,18 +44,18 @@ static bool zless(AVLNode *lhs, AVLNode *rhs) {
 
 // insert into the AVL tree
 static void tree_add(ZSet *zset, ZNode *node) {
-    if (!zset->tree) {
-        zset->tree = &node->tree;
+    if (!zset->big->tree) {
+        zset->big->tree = &node->tree;
         return;
     }
 
-    AVLNode *cur = zset->tree;
+    AVLNode *cur = zset->big->tree;
     while (true) {
         AVLNode **from = zless(&node->tree, cur) ? &cur->left : &cur->right;
         if (!*from) {
             *from = &node->tree;
             node->tree.parent = cur;
-            zset->tree = avl_fix(&node->tree);
+            zset->big->tree = avl_fix(&node->tree);
             break;
         }
         cur = *from;
@@ -63,94 +63,69 @@ static void tree_add(ZSet *zset, ZNode *node) {
 }
 
 // update the score of an existing node (AVL tree reinsertion)
-static void zset_update(ZSet *zset, ZNode *node, double score) {
+static void tree_update(ZSet *zset, ZNode *node, double score) {
     if (node->score == score) {
         return;
     }
-    zset->tree = avl_del(&node->tree);
+    zset->big->tree = avl_del(&node->tree);
     node->score = score;
     avl_init(&node->tree);
     tree_add(zset, node);
 }
 
-// add a new (score, name) tuple, or update the score of the existing tuple
-bool zset_add(ZSet *zset, const char *name, size_t len, double score) {
-    ZNode *node = zset_lookup(zset, name, len);
-    if (node) {
-        zset_update(zset, node, score);
-        return false;
-    } else {
-        node = znode_new(name, len, score);
-        hm_insert(&zset->hmap, &node->hmap);
-        tree_add(zset, node);
-        return true;
-    }
-}
-
 // a helper structure for the hashtable lookup
 struct HKey {
-    HNode node;
     const char *name = NULL;
     size_t len = 0;
 };
 
-static bool hcmp(HNode *node, HNode *key) {
-    if (node->hcode != key->hcode) {
-        return false;
+// name -> ZNode, 比较在编译期确定
+struct ZNodeTr {
+    typedef ZNode T;
+    typedef HKey Key;
+    static const size_t offset = offsetof(ZNode, hmap);
+    static uint64_t hash(const HKey &key) {
+        return str_hash((uint8_t *)key.name, key.len);
     }
-    ZNode *znode = container_of(node, ZNode, hmap);
-    HKey *hkey = container_of(key, HKey, node);
-    if (znode->len != hkey->len) {
-        return false;
+    static bool eq(ZNode *znode, const HKey &key) {
+        return znode->len == key.len && 0 == memcmp(znode->name, key.name, key.len);
     }
-    return 0 == memcmp(znode->name, hkey->name, znode->len);
-}
+};
 
 // lookup by name
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len) {
-    if (!zset->tree) {
+static ZNode *tree_lookup(ZSet *zset, const char *name, size_t len) {
+    if (!zset->big->tree) {
         return NULL;
     }
 
     HKey key;
-    key.node.hcode = str_hash((uint8_t *)name, len);
     key.name = name;
     key.len = len;
-    HNode *found = hm_lookup(&zset->hmap, &key.node, &hcmp);
-    if (!found) {
-        return NULL;
-    }
-
-    return container_of(found, ZNode, hmap);
+    return hm_lookup<ZNodeTr>(&zset->big->hmap, key);
 }
 
 // deletion by name
-ZNode *zset_pop(ZSet *zset, const char *name, size_t len) {
-    if (!zset->tree) {
+static ZNode *tree_pop(ZSet *zset, const char *name, size_t len) {
+    if (!zset->big->tree) {
         return NULL;
     }
 
     HKey key;
-    key.node.hcode = str_hash((uint8_t *)name, len);
     key.name = name;
     key.len = len;
-    HNode *found = hm_pop(&zset->hmap, &key.node, &hcmp);
-    if (!found) {
+    ZNode *node = hm_pop<ZNodeTr>(&zset->big->hmap, key);
+    if (!node) {
         return NULL;
     }
 
-    ZNode *node = container_of(found, ZNode, hmap);
-    zset->tree = avl_del(&node->tree);
+    zset->big->tree = avl_del(&node->tree);
     return node;
 }
 
-// find the (score, name) tuple that is greater or equal to the argument,
-// then offset relative to it.
-ZNode *zset_query(
-    ZSet *zset, double score, const char *name, size_t len, int64_t offset)
-{
+// find the (score, name) tuple that is greater or equal to the argument
+static AVLNode *tree_seek(ZSet *zset, double score, const char *name, size_t len) {
     AVLNode *found = NULL;
-    AVLNode *cur = zset->tree;
+    AVLNode *cur = zset->big->tree;
     while (cur) {
         if (zless(cur, score, name, len)) {
             cur = cur->right;
@@ -159,17 +134,409 @@ ZNode *zset_query(
             cur = cur->left;
         }
     }
+    return found;
+}
 
-    if (found) {
-        found = avl_offset(found, offset);
+// 按排名找节点，根的排名就是左子树的大小，从根offset过去
+static AVLNode *tree_at(ZSet *zset, uint64_t rank) {
+    AVLNode *root = zset->big->tree;
+    if (rank >= avl_cnt(root)) {
+        return NULL;
     }
-    return found ? container_of(found, ZNode, tree) : NULL;
+    return avl_offset(root, (int64_t)rank - (int64_t)avl_cnt(root->left));
+}
+
+// 分数小于score(inclusive时是小于等于)的元素个数，从根往下走一遍
+static uint64_t tree_count_below(ZSet *zset, double score, bool inclusive) {
+    AVLNode *cur = zset->big->tree;
+    uint64_t n = 0;
+    while (cur) {
+        double s = container_of(cur, ZNode, tree)->score;
+        if (s < score || (inclusive && s == score)) {
+            n += avl_cnt(cur->left) + 1;
+            cur = cur->right;
+        } else {
+            cur = cur->left;
+        }
+    }
+    return n;
+}
+
+// 紧凑编码的阈值，和Redis的zset-max-listpack-*默认值一样
+const uint32_t k_pack_max_n = 128;
+const size_t k_pack_max_name = 64;
+
+// 紧凑编码里的一个元素: double score | uint8_t len | name | uint8_t len
+// 末尾再存一次长度，从后一个元素可以直接退回到前一个
+static double pk_score(const uint8_t *p) {
+    double score;
+    memcpy(&score, p, sizeof(score));
+    return score;
+}
+
+static size_t pk_len(const uint8_t *p) {
+    return p[8];
+}
+
+static const char *pk_name(const uint8_t *p) {
+    return (const char *)p + 9;
+}
+
+static uint32_t pk_size(size_t len) {
+    return (uint32_t)len + 10;
+}
+
+static uint32_t pk_next(ZSet *zset, uint32_t off) {
+    return off + pk_size(pk_len(zset->pack + off));
+}
+
+static uint32_t pk_prev(ZSet *zset, uint32_t off) {
+    return off - pk_size(zset->pack[off - 1]);
+}
+
+// 和zless一样按(score, name)比较
+static bool pk_less(const uint8_t *p, double score, const char *name, size_t len) {
+    double s = pk_score(p);
+    if (s != score) {
+        return s < score;
+    }
+    size_t plen = pk_len(p);
+    int rv = memcmp(pk_name(p), name, min(plen, len));
+    if (rv != 0) {
+        return rv < 0;
+    }
+    return plen < len;
+}
+
+// 按名字找，*rank是它前面的元素个数，没有时返回pack_bytes
+static uint32_t pk_find(ZSet *zset, const char *name, size_t len, uint64_t *rank) {
+    uint32_t off = 0;
+    uint64_t i = 0;
+    while (off < zset->pack_bytes) {
+        const uint8_t *p = zset->pack + off;
+        if (pk_len(p) == len && 0 == memcmp(pk_name(p), name, len)) {
+            break;
+        }
+        off = pk_next(zset, off);
+        i++;
+    }
+    *rank = i;
+    return off;
+}
+
+// 第一个不小于(score, name)的元素，*rank是它前面的元素个数
+static uint32_t pk_seek(
+    ZSet *zset, double score, const char *name, size_t len, uint64_t *rank)
+{
+    uint32_t off = 0;
+    uint64_t i = 0;
+    while (off < zset->pack_bytes && pk_less(zset->pack + off, score, name, len)) {
+        off = pk_next(zset, off);
+        i++;
+    }
+    *rank = i;
+    return off;
+}
+
+// 第rank个元素的偏移，rank等于元素个数时返回pack_bytes
+static uint32_t pk_at(ZSet *zset, uint64_t rank) {
+    uint32_t off = 0;
+    for (uint64_t i = 0; i < rank; ++i) {
+        off = pk_next(zset, off);
+    }
+    return off;
+}
+
+static void pk_add(ZSet *zset, const char *name, size_t len, double score) {
+    uint64_t rank = 0;
+    uint32_t off = pk_seek(zset, score, name, len, &rank);
+    uint32_t size = pk_size(len);
+    zset->pack = (uint8_t *)realloc(zset->pack, zset->pack_bytes + size);
+    assert(zset->pack);
+    uint8_t *p = zset->pack + off;
+    memmove(p + size, p, zset->pack_bytes - off);
+    memcpy(p, &score, sizeof(score));
+    p[8] = (uint8_t)len;
+    memcpy(p + 9, name, len);
+    p[size - 1] = (uint8_t)len;
+    zset->pack_bytes += size;
+    zset->pack_n++;
+}
+
+// 删除[start, stop)这段字节里的n个元素
+static void pk_erase(ZSet *zset, uint32_t start, uint32_t stop, uint32_t n) {
+    memmove(zset->pack + start, zset->pack + stop, zset->pack_bytes - stop);
+    zset->pack_bytes -= stop - start;
+    zset->pack_n -= n;
+    // 缩小不会失败，也不值得为此保留多余的空间
+    if (zset->pack_n == 0) {
+        free(zset->pack);
+        zset->pack = NULL;
+    }
+}
+
+// 转成tree + hmap，元素已经有序，依次插到树的最右边
+static void zset_to_tree(ZSet *zset) {
+    zset->big = new ZIndex();
+    for (uint32_t off = 0; off < zset->pack_bytes; off = pk_next(zset, off)) {
+        const uint8_t *p = zset->pack + off;
+        ZNode *node = znode_new(pk_name(p), pk_len(p), pk_score(p));
+        hm_insert(&zset->big->hmap, &node->hmap);
+        tree_add(zset, node);
+    }
+    free(zset->pack);
+    zset->pack = NULL;
+    zset->pack_n = zset->pack_bytes = 0;
+}
+
+// add a new (score, name) tuple, or update the score of the existing tuple
+bool zset_add(ZSet *zset, const char *name, size_t len, double score) {
+    if (!zset->big) {
+        uint64_t rank = 0;
+        uint32_t off = pk_find(zset, name, len, &rank);
+        if (off < zset->pack_bytes) {
+            if (pk_score(zset->pack + off) != score) {
+                pk_erase(zset, off, pk_next(zset, off), 1);
+                pk_add(zset, name, len, score);
+            }
+            return false;
+        }
+        if (len <= k_pack_max_name && zset->pack_n < k_pack_max_n) {
+            pk_add(zset, name, len, score);
+            return true;
+        }
+        zset_to_tree(zset);
+    }
+
+    ZNode *node = tree_lookup(zset, name, len);
+    if (node) {
+        tree_update(zset, node, score);
+        return false;
+    } else {
+        node = znode_new(name, len, score);
+        hm_insert(&zset->big->hmap, &node->hmap);
+        tree_add(zset, node);
+        return true;
+    }
+}
+
+bool zset_score(ZSet *zset, const char *name, size_t len, double *score) {
+    if (!zset->big) {
+        uint64_t rank = 0;
+        uint32_t off = pk_find(zset, name, len, &rank);
+        if (off == zset->pack_bytes) {
+            return false;
+        }
+        *score = pk_score(zset->pack + off);
+        return true;
+    }
+    ZNode *node = tree_lookup(zset, name, len);
+    if (node) {
+        *score = node->score;
+    }
+    return node != NULL;
+}
+
+bool zset_rem(ZSet *zset, const char *name, size_t len) {
+    if (!zset->big) {
+        uint64_t rank = 0;
+        uint32_t off = pk_find(zset, name, len, &rank);
+        if (off == zset->pack_bytes) {
+            return false;
+        }
+        pk_erase(zset, off, pk_next(zset, off), 1);
+        return true;
+    }
+    ZNode *node = tree_pop(zset, name, len);
+    if (node) {
+        znode_del(node);
+    }
+    return node != NULL;
+}
+
+// 排在这个元素前面的元素个数
+bool zset_rank(ZSet *zset, const char *name, size_t len, uint64_t *rank) {
+    if (!zset->big) {
+        return pk_find(zset, name, len, rank) < zset->pack_bytes;
+    }
+    ZNode *node = tree_lookup(zset, name, len);
+    if (node) {
+        *rank = avl_rank(&node->tree);
+    }
+    return node != NULL;
+}
+
+uint64_t zset_size(ZSet *zset) {
+    return zset->big ? avl_cnt(zset->big->tree) : zset->pack_n;
+}
+
+uint64_t zset_count_below(ZSet *zset, double score, bool inclusive) {
+    if (zset->big) {
+        return tree_count_below(zset, score, inclusive);
+    }
+    uint64_t n = 0;
+    for (uint32_t off = 0; off < zset->pack_bytes; off = pk_next(zset, off)) {
+        double s = pk_score(zset->pack + off);
+        if (!(s < score || (inclusive && s == score))) {
+            break;
+        }
+        n++;
+    }
+    return n;
+}
+
+// 分数在[min, max]之间的元素个数，minex/maxex表示不含端点
+uint64_t zset_count(ZSet *zset, double min, bool minex, double max, bool maxex) {
+    uint64_t hi = zset_count_below(zset, max, !maxex);
+    uint64_t lo = zset_count_below(zset, min, minex);
+    return hi > lo ? hi - lo : 0;
+}
+
+static ZIter zit_tree(ZSet *zset, AVLNode *node) {
+    ZIter it;
+    it.zset = zset;
+    it.znode = node ? container_of(node, ZNode, tree) : NULL;
+    it.ok = node != NULL;
+    return it;
+}
+
+static ZIter zit_pack(ZSet *zset, uint32_t off) {
+    ZIter it;
+    it.zset = zset;
+    it.off = off;
+    it.ok = off < zset->pack_bytes;
+    return it;
+}
+
+// find the (score, name) tuple that is greater or equal to the argument,
+// then offset relative to it.
+ZIter zset_query(
+    ZSet *zset, double score, const char *name, size_t len, int64_t offset)
+{
+    ZIter it;
+    if (zset->big) {
+        it = zit_tree(zset, tree_seek(zset, score, name, len));
+    } else {
+        uint64_t rank = 0;
+        it = zit_pack(zset, pk_seek(zset, score, name, len, &rank));
+    }
+    return it.ok ? zit_offset(it, offset) : it;
+}
+
+ZIter zset_at(ZSet *zset, uint64_t rank) {
+    if (zset->big) {
+        return zit_tree(zset, tree_at(zset, rank));
+    }
+    return rank < zset->pack_n ? zit_pack(zset, pk_at(zset, rank)) : ZIter{};
+}
+
+// 紧凑编码最多k_pack_max_n个元素，逐个走过去就行
+ZIter zit_offset(ZIter it, int64_t offset) {
+    assert(it.ok);
+    ZSet *zset = it.zset;
+    if (zset->big) {
+        return zit_tree(zset, avl_offset(&it.znode->tree, offset));
+    }
+    for (; offset > 0 && it.ok; --offset) {
+        it.off = pk_next(zset, it.off);
+        it.ok = it.off < zset->pack_bytes;
+    }
+    for (; offset < 0 && it.ok; ++offset) {
+        it.ok = it.off > 0;
+        it.off = it.ok ? pk_prev(zset, it.off) : 0;
+    }
+    return it;
+}
+
+double zit_score(ZIter it) {
+    return it.zset->big ? it.znode->score : pk_score(it.zset->pack + it.off);
+}
+
+const char *zit_name(ZIter it, size_t *len) {
+    if (it.zset->big) {
+        *len = it.znode->len;
+        return it.znode->name;
+    }
+    *len = pk_len(it.zset->pack + it.off);
+    return pk_name(it.zset->pack + it.off);
+}
+
+// 按指针从hmap里摘掉，不用再算名字的hash和比较名字
+struct ZNodePtrTr {
+    typedef ZNode T;
+    typedef ZNode *Key;
+    static const size_t offset = offsetof(ZNode, hmap);
+    static uint64_t hash(ZNode *node) { return node->hmap.hcode; }
+    static bool eq(ZNode *znode, ZNode *key) { return znode == key; }
+};
+
+static AVLNode *tree_first(AVLNode *node) {
+    while (node && node->left) {
+        node = node->left;
+    }
+    return node;
+}
+
+// 删除排名在[start, stop)的元素，返回摘下来的子树，由调用者释放。
+// 树上只做两次split和一次join，O(log n)。hmap要逐个摘，
+// 剩下的比删掉的少时改成用剩下的重建，所以是O(min(k, n - k))
+AVLNode *zset_rem_range(ZSet *zset, uint64_t start, uint64_t stop) {
+    assert(stop <= zset_size(zset));
+    if (start >= stop) {
+        return NULL;
+    }
+    if (!zset->big) {
+        uint32_t lo = pk_at(zset, start);
+        uint32_t hi = pk_at(zset, stop);
+        pk_erase(zset, lo, hi, (uint32_t)(stop - start));
+        return NULL;
+    }
+    AVLNode *left = NULL, *mid = NULL, *right = NULL;
+    avl_split(zset->big->tree, start, &left, &right);
+    avl_split(right, stop - start, &mid, &right);
+    zset->big->tree = avl_join2(left, right);
+
+    if (stop - start > zset_size(zset)) {
+        hm_clear(&zset->big->hmap);
+        for (AVLNode *cur = tree_first(zset->big->tree); cur; cur = avl_offset(cur, +1)) {
+            hm_insert(&zset->big->hmap, &container_of(cur, ZNode, tree)->hmap);
+        }
+        return mid;
+    }
+    for (AVLNode *cur = tree_first(mid); cur; cur = avl_offset(cur, +1)) {
+        ZNode *znode = container_of(cur, ZNode, tree);
+        ZNode *popped = hm_pop<ZNodePtrTr>(&zset->big->hmap, znode, znode->hmap.hcode);
+        assert(popped == znode);
+    }
+    return mid;
 }
 
 void znode_del(ZNode *node) {
     free(node);
 }
 
+// 最多释放budget个节点，返回实际释放的个数，*tree变成剩下的部分。
+// 把左孩子旋转上来直到根没有左孩子，再释放根，不需要栈
+size_t zset_free_some(AVLNode **tree, size_t budget) {
+    size_t n = 0;
+    AVLNode *node = *tree;
+    while (node && n < budget) {
+        AVLNode *left = node->left;
+        if (left) {
+            node->left = left->right;
+            left->right = node;
+            node = left;
+        } else {
+            AVLNode *right = node->right;
+            znode_del(container_of(node, ZNode, tree));
+            node = right;
+            n++;
+        }
+    }
+    *tree = node;
+    return n;
+}
+
 static void tree_dispose(AVLNode *node) {
     if (!node) {
         return;
@@ -181,6 +548,15 @@ static void tree_dispose(AVLNode *node) {
 
 // destroy the zset
 void zset_dispose(ZSet *zset) {
-    tree_dispose(zset->tree);
-    hm_destroy(&zset->hmap);
+    free(zset->pack);
+    zset->pack = NULL;
+    zset->pack_n = zset->pack_bytes = 0;
+    if (!zset->big) {
+        return;
+    }
+    tree_dispose(zset->big->tree);
+    // 节点已经在tree_dispose中释放
+    hm_clear(&zset->big->hmap);
+    delete zset->big;
+    zset->big = NULL;
 }
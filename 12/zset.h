@@ -4,11 +4,22 @@
 #include "hashtable.h"
 
 
-struct ZSet {
+// 转成tree编码以后才分配，小集合不用背着这个
+struct ZIndex {
     AVLNode *tree = NULL;
     HMap hmap;
 };
 
+// 元素少而且名字都短的时候用紧凑编码：按(score, name)排好序首尾相接
+// 放在一块内存pack里，不需要ZNode，也不需要hmap的桶数组。
+// 超过阈值就转成AVL树加hmap，之后不再转回来
+struct ZSet {
+    uint8_t *pack = NULL;
+    uint32_t pack_n = 0;        // 元素个数
+    uint32_t pack_bytes = 0;
+    ZIndex *big = NULL;         // 已经转成tree + hmap
+};
+
 struct ZNode {
     AVLNode tree;
     HNode hmap;
@@ -17,11 +28,29 @@ struct ZNode {
     char name[0];
 };
 
+// 指向集合里的一个元素，两种编码通用
+struct ZIter {
+    ZSet *zset = NULL;
+    ZNode *znode = NULL;    // tree编码
+    uint32_t off = 0;       // 紧凑编码，元素在pack里的偏移
+    bool ok = false;
+};
+
 bool zset_add(ZSet *zset, const char *name, size_t len, double score);
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
-ZNode *zset_pop(ZSet *zset, const char *name, size_t len);
-ZNode *zset_query(
+bool zset_score(ZSet *zset, const char *name, size_t len, double *score);
+bool zset_rem(ZSet *zset, const char *name, size_t len);
+bool zset_rank(ZSet *zset, const char *name, size_t len, uint64_t *rank);
+uint64_t zset_size(ZSet *zset);
+uint64_t zset_count_below(ZSet *zset, double score, bool inclusive);
+uint64_t zset_count(ZSet *zset, double min, bool minex, double max, bool maxex);
+ZIter zset_query(
     ZSet *zset, double score, const char *name, size_t len, int64_t offset
 );
+ZIter zset_at(ZSet *zset, uint64_t rank);
+ZIter zit_offset(ZIter it, int64_t offset);
+double zit_score(ZIter it);
+const char *zit_name(ZIter it, size_t *len);
+AVLNode *zset_rem_range(ZSet *zset, uint64_t start, uint64_t stop);
+size_t zset_free_some(AVLNode **tree, size_t budget);
 void zset_dispose(ZSet *zset);
 void znode_del(ZNode *node);